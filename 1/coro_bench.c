@@ -0,0 +1,277 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "coro_timer.h"
+
+/**
+ * Micro-benchmark of the libcoro context switch. Build it with
+ * different backends ('make bench' does that) to compare them.
+ */
+
+enum {
+	/** Number of coroutines yielding to each other. */
+	BENCH_YIELD_COROS = 2,
+	/** Yields done by each coroutine. */
+	BENCH_YIELD_COUNT = 1000000,
+	/** Coroutines created and deleted one by one. */
+	BENCH_NEW_COUNT = 20000,
+	/**
+	 * Total yields done in the scheduler scaling test, split
+	 * between all the coroutines.
+	 */
+	BENCH_SCALE_YIELDS = 2000000,
+	/** Stack size for the scaling test to fit 100k coroutines. */
+	BENCH_SCALE_STACK = 16 * 1024,
+	/** Timers in the timer wheel test. */
+	BENCH_TIMER_COUNT = 1000000,
+	/** Coroutines sleeping in turns in the sleep test. */
+	BENCH_SLEEP_COROS = 100,
+	BENCH_SLEEP_COUNT = 5,
+	BENCH_SLEEP_NSEC = 10 * 1000000,
+};
+
+static long long
+bench_now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+/** Coroutines of the scaling test, which have started. */
+static int bench_started = 0;
+static int bench_total = 0;
+/** Resident memory in bytes, when all of them have started. */
+static long long bench_rss = 0;
+
+static long long
+bench_rss_bytes(void)
+{
+	long long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lld %lld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int
+bench_scale_f(void *arg)
+{
+	/* The last one to start sees all the stacks in use. */
+	if (++bench_started == bench_total)
+		bench_rss = bench_rss_bytes();
+	return bench_yield_f(arg);
+}
+
+static int
+bench_noop_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static void
+bench_timer_f(struct coro_timer *timer, void *arg)
+{
+	(void)timer;
+	++*(long long *)arg;
+}
+
+/**
+ * Cost of the timer wheel operations with a million timers, which
+ * expire in up to a minute.
+ */
+static void
+bench_timers(const char *name)
+{
+	struct coro_timer_wheel *w = malloc(sizeof(*w));
+	struct coro_timer *timers = calloc(BENCH_TIMER_COUNT, sizeof(*timers));
+	coro_timer_wheel_create(w, 0);
+	uint64_t span = coro_timer_tick(60 * 1000000000LL);
+	uint64_t seed = 1;
+	long long start = bench_now_nsec();
+	for (int i = 0; i < BENCH_TIMER_COUNT; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		coro_timer_add(w, &timers[i], 1 + (seed >> 33) % span);
+	}
+	long long add_nsec = bench_now_nsec() - start;
+	start = bench_now_nsec();
+	for (int i = 0; i < BENCH_TIMER_COUNT; i += 2)
+		coro_timer_remove(w, &timers[i]);
+	long long remove_nsec = bench_now_nsec() - start;
+	long long fired = 0;
+	start = bench_now_nsec();
+	coro_timer_wheel_advance(w, span, bench_timer_f, &fired);
+	long long fire_nsec = bench_now_nsec() - start;
+	printf("%s: %d timers, add %.1lf ns, remove %.1lf ns, expire %.1lf ns\n",
+	       name, BENCH_TIMER_COUNT, (double)add_nsec / BENCH_TIMER_COUNT,
+	       (double)remove_nsec / (BENCH_TIMER_COUNT / 2),
+	       (double)fire_nsec / fired);
+	free(timers);
+	free(w);
+}
+
+static int
+bench_sleep_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_SLEEP_COUNT; ++i)
+		coro_sleep(BENCH_SLEEP_NSEC);
+	return 0;
+}
+
+/**
+ * Coroutines, which all sleep, should let the thread sleep in the
+ * kernel instead of spinning. So the CPU time should be much less
+ * than the wall time.
+ */
+static void
+bench_sleep(const char *name)
+{
+	for (int i = 0; i < BENCH_SLEEP_COROS; ++i)
+		coro_new(bench_sleep_f, NULL);
+	long long start = bench_now_nsec();
+	clock_t cpu_start = clock();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long wall_nsec = bench_now_nsec() - start;
+	double cpu_nsec = (double)(clock() - cpu_start) * 1e9 / CLOCKS_PER_SEC;
+	printf("%s: %d coroutines sleep %d x %.1lf ms, took %.1lf ms, "
+	       "CPU %.1lf ms\n", name, BENCH_SLEEP_COROS, BENCH_SLEEP_COUNT,
+	       BENCH_SLEEP_NSEC / 1e6, wall_nsec / 1e6, cpu_nsec / 1e6);
+}
+
+/** A hook, counting the switches, as a cheap profiler would. */
+static void
+bench_hook_f(struct coro *c, void *arg)
+{
+	(void)c;
+	++*(long long *)arg;
+}
+
+/** Yield cost of two coroutines, in nanoseconds. */
+static double
+bench_yield(int count)
+{
+	for (int i = 0; i < BENCH_YIELD_COROS; ++i)
+		coro_new(bench_yield_f, &count);
+	long long start = bench_now_nsec();
+	long long switches = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	return (double)(bench_now_nsec() - start) / switches;
+}
+
+int
+main(int argc, char **argv)
+{
+	(void)argc;
+	coro_sched_init();
+
+	double yield = bench_yield(BENCH_YIELD_COUNT);
+
+	long long hook_calls = 0;
+	struct coro_hooks hooks = {
+		.switch_in = bench_hook_f,
+		.switch_out = bench_hook_f,
+		.arg = &hook_calls,
+	};
+	coro_set_hooks(&hooks);
+	double hooked_yield = bench_yield(BENCH_YIELD_COUNT);
+	coro_set_hooks(NULL);
+
+	long long start = bench_now_nsec();
+	for (int i = 0; i < BENCH_NEW_COUNT; ++i) {
+		coro_new(bench_noop_f, NULL);
+		coro_delete(coro_sched_wait());
+	}
+	long long new_nsec = bench_now_nsec() - start;
+
+	/*
+	 * A batch fanned out at once, collected one by one and joined
+	 * in a group. It costs mostly the stacks, which can't be
+	 * reused until the batch finishes.
+	 */
+	start = bench_now_nsec();
+	for (int i = 0; i < BENCH_NEW_COUNT; ++i)
+		coro_new(bench_noop_f, NULL);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long batch_nsec = bench_now_nsec() - start;
+
+	struct coro_group *group = coro_group_new();
+	start = bench_now_nsec();
+	for (int i = 0; i < BENCH_NEW_COUNT; ++i)
+		coro_group_spawn(group, bench_noop_f, NULL, NULL);
+	coro_group_join(group);
+	long long group_nsec = bench_now_nsec() - start;
+	coro_group_delete(group);
+
+	printf("%s: coro_yield %.1lf ns, with hooks %.1lf ns, coro_new + "
+	       "run + coro_delete %.1lf ns\n", argv[0], yield, hooked_yield,
+	       (double)new_nsec / BENCH_NEW_COUNT);
+	printf("%s: batch of %d, coro_sched_wait %.1lf ns, coro_group_join "
+	       "%.1lf ns per coroutine\n", argv[0], BENCH_NEW_COUNT,
+	       (double)batch_nsec / BENCH_NEW_COUNT,
+	       (double)group_nsec / BENCH_NEW_COUNT);
+
+	/*
+	 * Scheduling cost should not depend on how many coroutines
+	 * there are.
+	 */
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = BENCH_SCALE_STACK;
+	attr.stack_guard = false;
+	/*
+	 * The same with the shared stack, which costs a copy per
+	 * switch, but only the used part of the stack per coroutine.
+	 */
+	for (int shared = 0; shared <= 1; ++shared) {
+		attr.stack_shared = shared;
+		for (int n = 10; n <= 100000; n *= 100) {
+			int count = BENCH_SCALE_YIELDS / n;
+			bench_started = 0;
+			bench_total = n;
+			long long rss = bench_rss_bytes();
+			for (int i = 0; i < n; ++i)
+				coro_new_ex(bench_scale_f, &count, &attr);
+			start = bench_now_nsec();
+			long long switches = 0;
+			struct coro *c;
+			while ((c = coro_sched_wait()) != NULL) {
+				switches += coro_switch_count(c);
+				coro_delete(c);
+			}
+			long long yield_nsec = bench_now_nsec() - start;
+			printf("%s: %d coroutines%s, coro_yield %.1lf ns, "
+			       "%.1lf KB per coroutine\n", argv[0], n,
+			       shared ? " on a shared stack" : "",
+			       (double)yield_nsec / switches,
+			       (bench_rss - rss) / 1024.0 / n);
+		}
+	}
+	bench_timers(argv[0]);
+	bench_sleep(argv[0]);
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,61 @@
+#include "coro_clock.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+enum {
+	/** How long to measure the counter frequency. */
+	CORO_CLOCK_CALIBRATE_NSEC = 500 * 1000,
+};
+
+bool coro_clock_is_counter = false;
+double coro_clock_nsec_per_tick = 0;
+
+#if defined(__x86_64__)
+
+static long long
+coro_clock_monotonic_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif
+
+void
+coro_clock_init(void)
+{
+	if (coro_clock_nsec_per_tick != 0)
+		return;
+#if defined(__x86_64__)
+	/*
+	 * The TSC is usable only if its rate does not depend on
+	 * the CPU frequency and sleep states.
+	 */
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & (1 << 8)) == 0) {
+		coro_clock_nsec_per_tick = 1;
+		return;
+	}
+	/* The frequency is unknown, so it is measured. */
+	long long start_nsec = coro_clock_monotonic_nsec();
+	uint64_t start_ticks = __rdtsc();
+	long long end_nsec;
+	do {
+		end_nsec = coro_clock_monotonic_nsec();
+	} while (end_nsec - start_nsec < CORO_CLOCK_CALIBRATE_NSEC);
+	uint64_t end_ticks = __rdtsc();
+	coro_clock_nsec_per_tick = (double)(end_nsec - start_nsec) /
+				   (end_ticks - start_ticks);
+	coro_clock_is_counter = true;
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	coro_clock_nsec_per_tick = 1e9 / freq;
+	coro_clock_is_counter = true;
+#else
+	coro_clock_nsec_per_tick = 1;
+#endif
+}
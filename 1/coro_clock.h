@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Cheap monotonic clock for the scheduler time accounting. It
+ * counts in ticks of the CPU time stamp counter where it is
+ * reliable (invariant TSC on x86-64, the generic timer on
+ * aarch64), and in nanoseconds of CLOCK_MONOTONIC otherwise.
+ */
+
+/** True, if the ticks come from a hardware counter. */
+extern bool coro_clock_is_counter;
+/** Nanoseconds in one tick. */
+extern double coro_clock_nsec_per_tick;
+
+/** Choose the clock source and calibrate it. Idempotent. */
+void
+coro_clock_init(void);
+
+static inline uint64_t
+coro_clock_ticks(void)
+{
+#if defined(__x86_64__)
+	if (coro_clock_is_counter)
+		return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#endif
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline long long
+coro_clock_ticks_to_nsec(uint64_t ticks)
+{
+	return (long long)(ticks * coro_clock_nsec_per_tick);
+}
+
+static inline uint64_t
+coro_clock_nsec_to_ticks(long long nsec)
+{
+	return (uint64_t)(nsec / coro_clock_nsec_per_tick);
+}
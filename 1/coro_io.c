@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "libcoro.h"
+#include "coro_io.h"
+
+#if defined(__linux__) && ! defined(LIBCORO_IO_NO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define CORO_IO_URING 1
+#endif
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+enum {
+	/** Number of helper threads when there is no io_uring. */
+	CORO_IO_POOL_SIZE = 4,
+	/** Submission queue size of the io_uring. */
+	CORO_IO_RING_SIZE = 256,
+};
+
+enum coro_io_op {
+	CORO_IO_OPEN,
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+};
+
+enum coro_io_backend {
+	/** Not started yet. */
+	CORO_IO_NONE,
+	CORO_IO_BACKEND_URING,
+	CORO_IO_BACKEND_POOL,
+};
+
+/**
+ * One I/O operation. It lives on the stack of the coroutine,
+ * which waits for it.
+ */
+struct coro_io_req {
+	enum coro_io_op op;
+	int fd;
+	const char *path;
+	int flags;
+	mode_t mode;
+	void *buf;
+	size_t count;
+	/** Result of the system call, or -errno. */
+	ssize_t res;
+	/** Coroutine to wake up on completion. */
+	struct coro *coro;
+	/**
+	 * Held by the completer while it wakes the coroutine up,
+	 * so the request is not gone before it is done with it.
+	 */
+	struct coro_spinlock lock;
+	bool is_done;
+	/** Link in the helper pool queue. */
+	struct coro_io_req *next;
+};
+
+static struct {
+	/** enum coro_io_backend. Read without the lock. */
+	int backend;
+	/** Protects the start and the helper pool queue. */
+	pthread_mutex_t lock;
+#if CORO_IO_URING
+	int ring_fd;
+	/** Serializes the submissions. */
+	pthread_mutex_t sq_lock;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	/** Thread, waiting for completions. */
+	pthread_t reaper;
+#endif
+	pthread_t helpers[CORO_IO_POOL_SIZE];
+	pthread_cond_t cond;
+	struct coro_io_req *first, *last;
+	bool is_stopping;
+} coro_io = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#if CORO_IO_URING
+	.sq_lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/** Do the operation right here. */
+static ssize_t
+coro_io_exec(struct coro_io_req *req)
+{
+	ssize_t rc;
+	switch (req->op) {
+	case CORO_IO_OPEN:
+		rc = open(req->path, req->flags, req->mode);
+		break;
+	case CORO_IO_READ:
+		rc = read(req->fd, req->buf, req->count);
+		break;
+	default:
+		rc = write(req->fd, req->buf, req->count);
+		break;
+	}
+	return rc < 0 ? -errno : rc;
+}
+
+/** Store the result and resume the waiting coroutine. */
+static void
+coro_io_complete(struct coro_io_req *req, ssize_t res)
+{
+	coro_spinlock_lock(&req->lock);
+	req->res = res;
+	req->is_done = true;
+	coro_wakeup(req->coro);
+	coro_spinlock_unlock(&req->lock);
+}
+
+static void *
+coro_io_helper_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io.lock);
+	while (true) {
+		while (coro_io.first == NULL && ! coro_io.is_stopping)
+			pthread_cond_wait(&coro_io.cond, &coro_io.lock);
+		struct coro_io_req *req = coro_io.first;
+		if (req == NULL)
+			break;
+		coro_io.first = req->next;
+		if (coro_io.first == NULL)
+			coro_io.last = NULL;
+		pthread_mutex_unlock(&coro_io.lock);
+		coro_io_complete(req, coro_io_exec(req));
+		pthread_mutex_lock(&coro_io.lock);
+	}
+	pthread_mutex_unlock(&coro_io.lock);
+	return NULL;
+}
+
+static void
+coro_io_pool_submit(struct coro_io_req *req)
+{
+	req->next = NULL;
+	pthread_mutex_lock(&coro_io.lock);
+	if (coro_io.last != NULL)
+		coro_io.last->next = req;
+	else
+		coro_io.first = req;
+	coro_io.last = req;
+	pthread_cond_signal(&coro_io.cond);
+	pthread_mutex_unlock(&coro_io.lock);
+}
+
+#if CORO_IO_URING
+
+static int
+coro_io_uring_enter(unsigned to_submit, unsigned min_complete,
+		    unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, coro_io.ring_fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+/**
+ * Check that the kernel has the operations and can read and write
+ * at the current file position, which appeared later than
+ * io_uring itself.
+ */
+static bool
+coro_io_uring_is_supported(const struct io_uring_params *p)
+{
+	if ((p->features & IORING_FEAT_RW_CUR_POS) == 0)
+		return false;
+	size_t size = sizeof(struct io_uring_probe) +
+		      256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL)
+		return false;
+	bool ok = syscall(__NR_io_uring_register, coro_io.ring_fd,
+			  IORING_REGISTER_PROBE, probe, 256) == 0;
+	static const int ops[] = {
+		IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_READ,
+		IORING_OP_WRITE,
+	};
+	for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); ++i) {
+		ok = ops[i] <= probe->last_op &&
+		     (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+	free(probe);
+	return ok;
+}
+
+static void
+coro_io_uring_unmap(void)
+{
+	if (coro_io.sqes != NULL)
+		munmap(coro_io.sqes, coro_io.sqes_size);
+	if (coro_io.cq_ring != NULL && coro_io.cq_ring != coro_io.sq_ring)
+		munmap(coro_io.cq_ring, coro_io.cq_ring_size);
+	if (coro_io.sq_ring != NULL)
+		munmap(coro_io.sq_ring, coro_io.sq_ring_size);
+	close(coro_io.ring_fd);
+	coro_io.sqes = NULL;
+	coro_io.sq_ring = coro_io.cq_ring = NULL;
+}
+
+/** Create the ring. Return false, if it is not usable. */
+static bool
+coro_io_uring_create(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	coro_io.ring_fd = syscall(__NR_io_uring_setup, CORO_IO_RING_SIZE, &p);
+	if (coro_io.ring_fd < 0)
+		return false;
+	coro_io.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	coro_io.cq_ring_size = p.cq_off.cqes +
+			       p.cq_entries * sizeof(struct io_uring_cqe);
+	bool is_single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single && coro_io.cq_ring_size > coro_io.sq_ring_size)
+		coro_io.sq_ring_size = coro_io.cq_ring_size;
+	coro_io.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	coro_io.sq_ring = mmap(NULL, coro_io.sq_ring_size,
+			       PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, coro_io.ring_fd,
+			       IORING_OFF_SQ_RING);
+	if (coro_io.sq_ring == MAP_FAILED)
+		coro_io.sq_ring = NULL;
+	coro_io.cq_ring = coro_io.sq_ring;
+	if (! is_single && coro_io.sq_ring != NULL) {
+		coro_io.cq_ring = mmap(NULL, coro_io.cq_ring_size,
+				       PROT_READ | PROT_WRITE,
+				       MAP_SHARED | MAP_POPULATE,
+				       coro_io.ring_fd, IORING_OFF_CQ_RING);
+		if (coro_io.cq_ring == MAP_FAILED)
+			coro_io.cq_ring = NULL;
+	}
+	if (coro_io.cq_ring != NULL) {
+		coro_io.sqes = mmap(NULL, coro_io.sqes_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE,
+				    coro_io.ring_fd, IORING_OFF_SQES);
+		if (coro_io.sqes == MAP_FAILED)
+			coro_io.sqes = NULL;
+	}
+	if (coro_io.sqes == NULL || ! coro_io_uring_is_supported(&p)) {
+		coro_io_uring_unmap();
+		return false;
+	}
+	char *sq = coro_io.sq_ring;
+	char *cq = coro_io.cq_ring;
+	coro_io.sq_head = (unsigned *)(sq + p.sq_off.head);
+	coro_io.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	coro_io.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	coro_io.sq_array = (unsigned *)(sq + p.sq_off.array);
+	coro_io.cq_head = (unsigned *)(cq + p.cq_off.head);
+	coro_io.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	coro_io.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	coro_io.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+/**
+ * Push a request into the ring and pass it to the kernel. NULL
+ * is a NOP, which stops the reaper.
+ */
+static void
+coro_io_uring_submit(struct coro_io_req *req)
+{
+	pthread_mutex_lock(&coro_io.sq_lock);
+	unsigned tail = *coro_io.sq_tail;
+	unsigned i = tail & *coro_io.sq_mask;
+	struct io_uring_sqe *sqe = &coro_io.sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	if (req == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+	} else if (req->op == CORO_IO_OPEN) {
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)req->path;
+		sqe->len = req->mode;
+		sqe->open_flags = req->flags;
+	} else {
+		sqe->opcode = req->op == CORO_IO_READ ? IORING_OP_READ :
+							IORING_OP_WRITE;
+		sqe->fd = req->fd;
+		sqe->addr = (uint64_t)(uintptr_t)req->buf;
+		/* Short reads and writes are allowed anyway. */
+		sqe->len = req->count > INT_MAX ? INT_MAX : req->count;
+		/* -1 means the current file position. */
+		sqe->off = (uint64_t)-1;
+	}
+	coro_io.sq_array[i] = i;
+	__atomic_store_n(coro_io.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	/*
+	 * The kernel takes all submitted entries, unless the
+	 * completion queue is overflown. Then the reaper has to
+	 * drain it first.
+	 */
+	while (*coro_io.sq_tail !=
+	       __atomic_load_n(coro_io.sq_head, __ATOMIC_ACQUIRE)) {
+		unsigned count = *coro_io.sq_tail -
+				 __atomic_load_n(coro_io.sq_head,
+						 __ATOMIC_ACQUIRE);
+		if (coro_io_uring_enter(count, 0, 0) >= 0)
+			continue;
+		if (errno != EBUSY && errno != EAGAIN && errno != EINTR)
+			handle_error();
+		sched_yield();
+	}
+	pthread_mutex_unlock(&coro_io.sq_lock);
+}
+
+/** Wait for completions and wake the coroutines up. */
+static void *
+coro_io_reaper_f(void *arg)
+{
+	(void)arg;
+	bool is_stopping = false;
+	while (! is_stopping) {
+		unsigned head = *coro_io.cq_head;
+		unsigned tail = __atomic_load_n(coro_io.cq_tail,
+						__ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (coro_io_uring_enter(0, 1, IORING_ENTER_GETEVENTS)
+			    < 0 && errno != EINTR && errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe =
+				&coro_io.cqes[head & *coro_io.cq_mask];
+			struct coro_io_req *req =
+				(struct coro_io_req *)(uintptr_t)cqe->user_data;
+			if (req == NULL)
+				is_stopping = true;
+			else
+				coro_io_complete(req, cqe->res);
+		}
+		__atomic_store_n(coro_io.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+#endif /* CORO_IO_URING */
+
+/** Choose the backend and start its threads on the first use. */
+static void
+coro_io_start(void)
+{
+	if (__atomic_load_n(&coro_io.backend, __ATOMIC_ACQUIRE) != CORO_IO_NONE)
+		return;
+	pthread_mutex_lock(&coro_io.lock);
+	if (coro_io.backend != CORO_IO_NONE) {
+		pthread_mutex_unlock(&coro_io.lock);
+		return;
+	}
+	int backend = CORO_IO_BACKEND_POOL;
+#if CORO_IO_URING
+	if (coro_io_uring_create()) {
+		if (pthread_create(&coro_io.reaper, NULL, coro_io_reaper_f,
+				   NULL) != 0)
+			handle_error();
+		backend = CORO_IO_BACKEND_URING;
+	}
+#endif
+	if (backend == CORO_IO_BACKEND_POOL) {
+		coro_io.is_stopping = false;
+		for (int i = 0; i < CORO_IO_POOL_SIZE; ++i) {
+			if (pthread_create(&coro_io.helpers[i], NULL,
+					   coro_io_helper_f, NULL) != 0)
+				handle_error();
+		}
+	}
+	__atomic_store_n(&coro_io.backend, backend, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&coro_io.lock);
+}
+
+/**
+ * Execute the request. A coroutine is suspended until it is done,
+ * others just block. The request of a coroutine on a shared
+ * stack is moved to the heap, because the completion comes while
+ * the stack can be occupied by another coroutine.
+ */
+static ssize_t
+coro_io_do(struct coro_io_req *req)
+{
+	ssize_t res;
+	struct coro_io_req *heap_req = NULL;
+	if (! coro_is_inside()) {
+		res = coro_io_exec(req);
+	} else {
+		if (coro_stack_is_shared(coro_this())) {
+			heap_req = malloc(sizeof(*heap_req));
+			if (heap_req == NULL)
+				handle_error();
+			*heap_req = *req;
+			req = heap_req;
+		}
+		coro_io_start();
+		req->coro = coro_this();
+		req->is_done = false;
+		coro_spinlock_create(&req->lock);
+		coro_spinlock_lock(&req->lock);
+#if CORO_IO_URING
+		if (coro_io.backend == CORO_IO_BACKEND_URING)
+			coro_io_uring_submit(req);
+		else
+#endif
+			coro_io_pool_submit(req);
+		while (! req->is_done) {
+			coro_wait_unlock(&req->lock);
+			coro_spinlock_lock(&req->lock);
+		}
+		coro_spinlock_unlock(&req->lock);
+		res = req->res;
+		free(heap_req);
+	}
+	if (res >= 0)
+		return res;
+	errno = -res;
+	return -1;
+}
+
+int
+coro_open(const char *path, int flags, mode_t mode)
+{
+	struct coro_io_req req;
+	req.op = CORO_IO_OPEN;
+	req.path = path;
+	req.flags = flags;
+	req.mode = mode;
+	return coro_io_do(&req);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t count)
+{
+	struct coro_io_req req;
+	req.op = CORO_IO_READ;
+	req.fd = fd;
+	req.buf = buf;
+	req.count = count;
+	return coro_io_do(&req);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count)
+{
+	struct coro_io_req req;
+	req.op = CORO_IO_WRITE;
+	req.fd = fd;
+	req.buf = (void *)buf;
+	req.count = count;
+	return coro_io_do(&req);
+}
+
+void
+coro_io_destroy(void)
+{
+	pthread_mutex_lock(&coro_io.lock);
+	int backend = coro_io.backend;
+	coro_io.backend = CORO_IO_NONE;
+	if (backend == CORO_IO_BACKEND_POOL) {
+		coro_io.is_stopping = true;
+		pthread_cond_broadcast(&coro_io.cond);
+	}
+	pthread_mutex_unlock(&coro_io.lock);
+#if CORO_IO_URING
+	if (backend == CORO_IO_BACKEND_URING) {
+		coro_io_uring_submit(NULL);
+		pthread_join(coro_io.reaper, NULL);
+		coro_io_uring_unmap();
+	}
+#endif
+	if (backend == CORO_IO_BACKEND_POOL) {
+		for (int i = 0; i < CORO_IO_POOL_SIZE; ++i)
+			pthread_join(coro_io.helpers[i], NULL);
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * File I/O, which suspends only the calling coroutine instead of
+ * the whole thread. Requests are submitted to io_uring, when the
+ * kernel supports it, or to a pool of helper threads otherwise
+ * (and always with -DLIBCORO_IO_NO_URING). The coroutine is
+ * suspended via coro_wait() and is woken up on completion, so
+ * others run meanwhile. Called not from a coroutine, the
+ * functions just do blocking system calls.
+ *
+ * The results are the same as of open(), read() and write() -
+ * -1 and errno on error.
+ */
+
+/** Like open(2). */
+int
+coro_open(const char *path, int flags, mode_t mode);
+
+/** Like read(2), from the current file position. */
+ssize_t
+coro_read(int fd, void *buf, size_t count);
+
+/** Like write(2), at the current file position. */
+ssize_t
+coro_write(int fd, const void *buf, size_t count);
+
+/**
+ * Stop the I/O helper threads, if they were started. There
+ * should be no requests in progress.
+ */
+void
+coro_io_destroy(void);
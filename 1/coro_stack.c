@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "coro_stack.h"
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+#if !defined(MAP_STACK)
+#define MAP_STACK 0
+#endif
+
+enum {
+	/** How many stacks of one size can be cached at most. */
+	CORO_STACK_CACHE_MAX = 128,
+	/** How many different stack sizes can be cached. */
+	CORO_STACK_BUCKET_MAX = 8,
+};
+
+/** A word, used to fill the probed stacks. */
+static const uint64_t coro_stack_pattern = 0xDEADBEEFCAFEBABEULL;
+
+/**
+ * A cached stack. The link is stored inside the stack itself, on
+ * its top, which is touched by any coroutine anyway.
+ */
+struct coro_stack_free {
+	struct coro_stack_free *next;
+};
+
+/** Free list of the stacks of one size and guard flag. */
+struct coro_stack_bucket {
+	size_t size;
+	bool is_guarded;
+	int count;
+	struct coro_stack_free *first;
+};
+
+/** Each thread has own cache, so no locks are needed. */
+static __thread struct coro_stack_bucket
+	coro_stack_buckets[CORO_STACK_BUCKET_MAX];
+static size_t coro_stack_page_size = 0;
+
+static size_t
+coro_stack_page(void)
+{
+	if (coro_stack_page_size == 0)
+		coro_stack_page_size = sysconf(_SC_PAGESIZE);
+	return coro_stack_page_size;
+}
+
+static struct coro_stack_bucket *
+coro_stack_bucket_find(size_t size, bool guard, bool create)
+{
+	struct coro_stack_bucket *empty = NULL;
+	for (int i = 0; i < CORO_STACK_BUCKET_MAX; ++i) {
+		struct coro_stack_bucket *b = &coro_stack_buckets[i];
+		if (b->size == size && b->is_guarded == guard)
+			return b;
+		if (b->size == 0 && empty == NULL)
+			empty = b;
+	}
+	if (! create || empty == NULL)
+		return NULL;
+	empty->size = size;
+	empty->is_guarded = guard;
+	return empty;
+}
+
+static inline struct coro_stack_free *
+coro_stack_free_link(void *base, size_t size)
+{
+	return (struct coro_stack_free *)((char *)base + size) - 1;
+}
+
+static void
+coro_stack_unmap(void *base, size_t size, bool guard)
+{
+	size_t page = guard ? coro_stack_page() : 0;
+	if (munmap((char *)base - page, size + page) != 0)
+		handle_error();
+}
+
+void
+coro_stack_create(struct coro_stack *stack, size_t size, bool probe,
+		  bool guard)
+{
+	size_t page = coro_stack_page();
+	size = (size + page - 1) & ~(page - 1);
+	stack->size = size;
+	stack->is_probed = probe;
+	stack->is_guarded = guard;
+	struct coro_stack_bucket *b =
+		coro_stack_bucket_find(size, guard, false);
+	if (b != NULL && b->first != NULL) {
+		struct coro_stack_free *f = b->first;
+		b->first = f->next;
+		--b->count;
+		stack->base = (char *)(f + 1) - size;
+	} else {
+		size_t guard_size = guard ? page : 0;
+		char *map = mmap(NULL, size + guard_size,
+				 PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+				 -1, 0);
+		if (map == MAP_FAILED)
+			handle_error();
+		/* Stack grows down, so the guard is below it. */
+		if (guard && mprotect(map, guard_size, PROT_NONE) != 0)
+			handle_error();
+		stack->base = map + guard_size;
+	}
+	if (probe) {
+		uint64_t *it = stack->base;
+		uint64_t *end = it + size / sizeof(*it);
+		for (; it < end; ++it)
+			*it = coro_stack_pattern;
+	}
+}
+
+void
+coro_stack_destroy(struct coro_stack *stack)
+{
+	struct coro_stack_bucket *b = coro_stack_bucket_find(stack->size,
+		stack->is_guarded, true);
+	if (b == NULL || b->count >= CORO_STACK_CACHE_MAX) {
+		coro_stack_unmap(stack->base, stack->size,
+				 stack->is_guarded);
+		return;
+	}
+	struct coro_stack_free *f =
+		coro_stack_free_link(stack->base, stack->size);
+	f->next = b->first;
+	b->first = f;
+	++b->count;
+}
+
+long long
+coro_stack_used(const struct coro_stack *stack)
+{
+	if (! stack->is_probed)
+		return -1;
+	/* Stack grows down, the untouched part is at the bottom. */
+	const uint64_t *it = stack->base;
+	const uint64_t *end = it + stack->size / sizeof(*it);
+	while (it < end && *it == coro_stack_pattern)
+		++it;
+	return (const char *)end - (const char *)it;
+}
+
+void
+coro_stack_cache_flush(void)
+{
+	for (int i = 0; i < CORO_STACK_BUCKET_MAX; ++i) {
+		struct coro_stack_bucket *b = &coro_stack_buckets[i];
+		struct coro_stack_free *f = b->first;
+		while (f != NULL) {
+			struct coro_stack_free *next = f->next;
+			coro_stack_unmap((char *)(f + 1) - b->size, b->size,
+					 b->is_guarded);
+			f = next;
+		}
+		b->first = NULL;
+		b->count = 0;
+		b->size = 0;
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Coroutine stack allocator. Stacks are mmap'd with a PROT_NONE
+ * guard page below them, so an overflow crashes right away
+ * instead of silently corrupting the neighbour memory. Freed
+ * stacks are not unmapped but cached in free lists, one per stack
+ * size and guard flag, and are reused by the next allocations of
+ * the same kind. The cache is per thread.
+ */
+
+/** A stack, owned by one coroutine. */
+struct coro_stack {
+	/** The lowest usable address, right above the guard page. */
+	void *base;
+	/** Usable size in bytes, without the guard page. */
+	size_t size;
+	/** True, if the stack is filled with a pattern to probe it. */
+	bool is_probed;
+	/** True, if there is a guard page below the stack. */
+	bool is_guarded;
+};
+
+/**
+ * Get a stack of at least @a size bytes. It is rounded up to a
+ * page size. If @a probe is true, the stack is filled with a
+ * pattern to be able to measure its max usage later. @a guard
+ * tells whether to protect it with a guard page.
+ */
+void
+coro_stack_create(struct coro_stack *stack, size_t size, bool probe,
+		  bool guard);
+
+/** Return the stack into the cache. */
+void
+coro_stack_destroy(struct coro_stack *stack);
+
+/**
+ * Max number of bytes ever used in a probed stack. -1, if the
+ * stack was not probed.
+ */
+long long
+coro_stack_used(const struct coro_stack *stack);
+
+/** Unmap all the stacks, cached by the current thread. */
+void
+coro_stack_cache_flush(void);
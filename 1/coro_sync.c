@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include "libcoro.h"
+#include "coro_sync.h"
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+/**
+ * A suspended coroutine in a wait list. It lives on the stack of
+ * that coroutine while it waits, or on the heap if the stack is
+ * shared, because then the stack is overwritten by others.
+ */
+struct coro_waiter {
+	struct coro *coro;
+	struct coro_waiter *next, *prev;
+	/** True, if it is in a list. */
+	bool is_linked;
+};
+
+struct coro_chan {
+	struct coro_spinlock lock;
+	/** Ring buffer of the items. */
+	void **items;
+	int capacity;
+	/** Index of the first item. */
+	int head;
+	int count;
+	bool is_closed;
+	/** Receivers, waiting for items. */
+	struct coro_wait_list readers;
+	/** Senders, waiting for free space. */
+	struct coro_wait_list writers;
+};
+
+static void
+coro_wait_list_create(struct coro_wait_list *l)
+{
+	l->first = l->last = NULL;
+}
+
+static inline bool
+coro_wait_list_is_empty(const struct coro_wait_list *l)
+{
+	return l->first == NULL;
+}
+
+static void
+coro_wait_list_remove(struct coro_wait_list *l, struct coro_waiter *w)
+{
+	if (w->prev != NULL)
+		w->prev->next = w->next;
+	else
+		l->first = w->next;
+	if (w->next != NULL)
+		w->next->prev = w->prev;
+	else
+		l->last = w->prev;
+	w->is_linked = false;
+}
+
+/**
+ * Suspend the current coroutine in the end of the list until it
+ * is woken up by coro_wait_list_wakeup_one/all(), or until the
+ * @a deadline, if it is not negative. @a lock protects the list.
+ * It should be held, is released for the wait time, and is held
+ * again on return. Return false, if the deadline has come first.
+ */
+static bool
+coro_wait_list_wait(struct coro_wait_list *l, struct coro_spinlock *lock,
+		    long long deadline)
+{
+	struct coro_waiter stack_w;
+	struct coro_waiter *w = &stack_w;
+	if (coro_stack_is_shared(coro_this())) {
+		w = malloc(sizeof(*w));
+		if (w == NULL)
+			handle_error();
+	}
+	w->coro = coro_this();
+	w->next = NULL;
+	w->prev = l->last;
+	w->is_linked = true;
+	if (l->last != NULL)
+		l->last->next = w;
+	else
+		l->first = w;
+	l->last = w;
+	bool ok = true;
+	if (deadline < 0)
+		coro_wait_unlock(lock);
+	else
+		ok = coro_wait_unlock_deadline(lock, deadline);
+	coro_spinlock_lock(lock);
+	/* The wakeup could be not from the list. */
+	if (w->is_linked)
+		coro_wait_list_remove(l, w);
+	if (w != &stack_w)
+		free(w);
+	return ok;
+}
+
+/** Wake up the first waiter. Return it, or NULL if none. */
+static struct coro *
+coro_wait_list_wakeup_one(struct coro_wait_list *l)
+{
+	struct coro_waiter *w = l->first;
+	if (w == NULL)
+		return NULL;
+	struct coro *c = w->coro;
+	coro_wait_list_remove(l, w);
+	coro_wakeup(c);
+	return c;
+}
+
+static void
+coro_wait_list_wakeup_all(struct coro_wait_list *l)
+{
+	while (coro_wait_list_wakeup_one(l) != NULL)
+		;
+}
+
+void
+coro_mutex_create(struct coro_mutex *m)
+{
+	coro_spinlock_create(&m->lock);
+	m->owner = NULL;
+	coro_wait_list_create(&m->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *m)
+{
+	assert(m->owner == NULL);
+	assert(coro_wait_list_is_empty(&m->waiters));
+	(void)m;
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	struct coro *self = coro_this();
+	coro_spinlock_lock(&m->lock);
+	assert(m->owner != self);
+	if (m->owner == NULL)
+		m->owner = self;
+	/* Unlock hands the mutex over directly to the waiter. */
+	while (m->owner != self)
+		coro_wait_list_wait(&m->waiters, &m->lock, -1);
+	coro_spinlock_unlock(&m->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	coro_spinlock_lock(&m->lock);
+	bool ok = m->owner == NULL;
+	if (ok)
+		m->owner = coro_this();
+	coro_spinlock_unlock(&m->lock);
+	return ok;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	coro_spinlock_lock(&m->lock);
+	assert(m->owner == coro_this());
+	/*
+	 * Direct handoff keeps the order fair - a coroutine can't
+	 * take the mutex again before the waiters got it.
+	 */
+	m->owner = coro_wait_list_wakeup_one(&m->waiters);
+	coro_spinlock_unlock(&m->lock);
+}
+
+void
+coro_cond_create(struct coro_cond *c)
+{
+	coro_spinlock_create(&c->lock);
+	coro_wait_list_create(&c->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *c)
+{
+	assert(coro_wait_list_is_empty(&c->waiters));
+	(void)c;
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	/*
+	 * The condvar is locked before the mutex is released, so
+	 * a signal sent under the mutex is not lost.
+	 */
+	coro_spinlock_lock(&c->lock);
+	coro_mutex_unlock(m);
+	coro_wait_list_wait(&c->waiters, &c->lock, -1);
+	coro_spinlock_unlock(&c->lock);
+	coro_mutex_lock(m);
+}
+
+bool
+coro_cond_wait_deadline(struct coro_cond *c, struct coro_mutex *m,
+			long long deadline)
+{
+	coro_spinlock_lock(&c->lock);
+	coro_mutex_unlock(m);
+	bool ok = coro_wait_list_wait(&c->waiters, &c->lock, deadline);
+	coro_spinlock_unlock(&c->lock);
+	coro_mutex_lock(m);
+	return ok;
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	coro_spinlock_lock(&c->lock);
+	coro_wait_list_wakeup_one(&c->waiters);
+	coro_spinlock_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	coro_spinlock_lock(&c->lock);
+	coro_wait_list_wakeup_all(&c->waiters);
+	coro_spinlock_unlock(&c->lock);
+}
+
+struct coro_chan *
+coro_chan_new(int capacity)
+{
+	assert(capacity > 0);
+	struct coro_chan *ch = malloc(sizeof(*ch));
+	if (ch == NULL)
+		return NULL;
+	ch->items = malloc(capacity * sizeof(ch->items[0]));
+	if (ch->items == NULL) {
+		free(ch);
+		return NULL;
+	}
+	coro_spinlock_create(&ch->lock);
+	ch->capacity = capacity;
+	ch->head = 0;
+	ch->count = 0;
+	ch->is_closed = false;
+	coro_wait_list_create(&ch->readers);
+	coro_wait_list_create(&ch->writers);
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	assert(coro_wait_list_is_empty(&ch->readers));
+	assert(coro_wait_list_is_empty(&ch->writers));
+	free(ch->items);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *item)
+{
+	coro_spinlock_lock(&ch->lock);
+	while (! ch->is_closed && ch->count == ch->capacity &&
+	       ! coro_is_cancelled())
+		coro_wait_list_wait(&ch->writers, &ch->lock, -1);
+	if (ch->is_closed || ch->count == ch->capacity) {
+		coro_spinlock_unlock(&ch->lock);
+		return -1;
+	}
+	ch->items[(ch->head + ch->count) % ch->capacity] = item;
+	++ch->count;
+	coro_wait_list_wakeup_one(&ch->readers);
+	coro_spinlock_unlock(&ch->lock);
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **item)
+{
+	coro_spinlock_lock(&ch->lock);
+	while (! ch->is_closed && ch->count == 0 && ! coro_is_cancelled())
+		coro_wait_list_wait(&ch->readers, &ch->lock, -1);
+	if (ch->count == 0) {
+		coro_spinlock_unlock(&ch->lock);
+		return -1;
+	}
+	*item = ch->items[ch->head];
+	ch->head = (ch->head + 1) % ch->capacity;
+	--ch->count;
+	coro_wait_list_wakeup_one(&ch->writers);
+	coro_spinlock_unlock(&ch->lock);
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	coro_spinlock_lock(&ch->lock);
+	ch->is_closed = true;
+	coro_wait_list_wakeup_all(&ch->readers);
+	coro_wait_list_wakeup_all(&ch->writers);
+	coro_spinlock_unlock(&ch->lock);
+}
+
+int
+coro_chan_count(const struct coro_chan *ch)
+{
+	return __atomic_load_n(&ch->count, __ATOMIC_RELAXED);
+}
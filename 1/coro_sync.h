@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include "libcoro.h"
+
+/**
+ * Synchronization primitives for coroutines. Waiting coroutines
+ * are suspended via coro_wait() and do not take part in
+ * scheduling until they are woken up. The primitives are safe to
+ * use from coroutines on different worker threads.
+ */
+
+struct coro;
+struct coro_waiter;
+
+/** FIFO of suspended coroutines. */
+struct coro_wait_list {
+	struct coro_waiter *first, *last;
+};
+
+/** Coroutine mutex. */
+struct coro_mutex {
+	struct coro_spinlock lock;
+	/** Coroutine, holding the mutex. NULL, if it is free. */
+	struct coro *owner;
+	/** Coroutines, waiting for the mutex. */
+	struct coro_wait_list waiters;
+};
+
+/** Coroutine condition variable. */
+struct coro_cond {
+	struct coro_spinlock lock;
+	struct coro_wait_list waiters;
+};
+
+/** Bounded multi-producer multi-consumer queue of pointers. */
+struct coro_chan;
+
+void
+coro_mutex_create(struct coro_mutex *m);
+
+/** The mutex should not be locked. */
+void
+coro_mutex_destroy(struct coro_mutex *m);
+
+/** Lock the mutex. Suspend until it is free, if needed. */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Try to lock the mutex without suspension. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/**
+ * Unlock the mutex. It is handed over to the first waiter, if
+ * there are any.
+ */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+void
+coro_cond_create(struct coro_cond *c);
+
+/** There should be no waiters. */
+void
+coro_cond_destroy(struct coro_cond *c);
+
+/**
+ * Unlock the mutex, suspend until the condition is signaled,
+ * and lock the mutex again.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/**
+ * Same as coro_cond_wait(), but stop waiting, when coro_now_nsec()
+ * reaches @a deadline. The mutex is locked again in any case.
+ * Return false, if the deadline has come before a signal.
+ */
+bool
+coro_cond_wait_deadline(struct coro_cond *c, struct coro_mutex *m,
+			long long deadline);
+
+/** Wake up one waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/**
+ * Create a channel with space for @a capacity items, >= 1.
+ * Return NULL, if there is no memory.
+ */
+struct coro_chan *
+coro_chan_new(int capacity);
+
+/** The channel should have no waiters. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Push an item into the channel. Suspend while it is full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, or the coroutine is cancelled
+ *         while waiting.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *item);
+
+/**
+ * Pop an item from the channel. Suspend while it is empty.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and has no items left, or the
+ *         coroutine is cancelled while waiting.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **item);
+
+/**
+ * Forbid new items. Waiters are woken up, receivers still can
+ * get the items left in the channel.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/** Number of items in the channel. */
+int
+coro_chan_count(const struct coro_chan *ch);
@@ -0,0 +1,148 @@
+#include <string.h>
+#include "coro_timer.h"
+
+void
+coro_timer_wheel_create(struct coro_timer_wheel *w, uint64_t tick)
+{
+	memset(w, 0, sizeof(*w));
+	w->tick = tick;
+}
+
+/**
+ * Put the timer into the lowest level, which covers its
+ * expiration. A timer beyond the wheel span goes to the last slot
+ * of the top level, and is placed again when it is reached.
+ */
+static void
+coro_timer_link(struct coro_timer_wheel *w, struct coro_timer *timer)
+{
+	uint64_t delta = timer->expire - w->tick;
+	uint64_t pos = timer->expire;
+	int level = 0;
+	while (level < CORO_TIMER_LEVELS - 1 &&
+	       delta >= 1ULL << (CORO_TIMER_SLOT_BITS * (level + 1)))
+		++level;
+	if (delta >= 1ULL << (CORO_TIMER_SLOT_BITS * CORO_TIMER_LEVELS))
+		pos = w->tick +
+		      (1ULL << (CORO_TIMER_SLOT_BITS * CORO_TIMER_LEVELS)) - 1;
+	int slot = (pos >> (CORO_TIMER_SLOT_BITS * level)) &
+		   (CORO_TIMER_SLOTS - 1);
+	struct coro_timer **head = &w->slots[level][slot];
+	timer->next = *head;
+	if (*head != NULL)
+		(*head)->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+	timer->level = level;
+	timer->slot = slot;
+	w->occupied[level] |= 1ULL << slot;
+}
+
+static void
+coro_timer_unlink(struct coro_timer_wheel *w, struct coro_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	if (w->slots[timer->level][timer->slot] == NULL)
+		w->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+void
+coro_timer_add(struct coro_timer_wheel *w, struct coro_timer *timer,
+	       uint64_t expire)
+{
+	if (expire <= w->tick)
+		expire = w->tick + 1;
+	timer->expire = expire;
+	timer->is_armed = true;
+	coro_timer_link(w, timer);
+	++w->count;
+}
+
+void
+coro_timer_remove(struct coro_timer_wheel *w, struct coro_timer *timer)
+{
+	if (! timer->is_armed)
+		return;
+	coro_timer_unlink(w, timer);
+	timer->is_armed = false;
+	--w->count;
+}
+
+/**
+ * Move the timers of the reached higher level slots down. A slot
+ * of a level is reached, when the current tick is the start of
+ * it, so the level above is checked only if this one has wrapped
+ * around.
+ */
+static void
+coro_timer_cascade(struct coro_timer_wheel *w)
+{
+	for (int level = 1; level < CORO_TIMER_LEVELS; ++level) {
+		int slot = (w->tick >> (CORO_TIMER_SLOT_BITS * level)) &
+			   (CORO_TIMER_SLOTS - 1);
+		struct coro_timer *timer = w->slots[level][slot];
+		w->slots[level][slot] = NULL;
+		w->occupied[level] &= ~(1ULL << slot);
+		while (timer != NULL) {
+			struct coro_timer *next = timer->next;
+			coro_timer_link(w, timer);
+			timer = next;
+		}
+		if (slot != 0)
+			break;
+	}
+}
+
+void
+coro_timer_wheel_advance(struct coro_timer_wheel *w, uint64_t tick,
+			 coro_timer_f f, void *arg)
+{
+	while (w->tick < tick) {
+		/* The ticks in between have nothing to do. */
+		uint64_t next = coro_timer_wheel_next(w);
+		if (next > tick) {
+			w->tick = tick;
+			break;
+		}
+		w->tick = next;
+		if ((next & (CORO_TIMER_SLOTS - 1)) == 0)
+			coro_timer_cascade(w);
+		struct coro_timer **head =
+			&w->slots[0][next & (CORO_TIMER_SLOTS - 1)];
+		struct coro_timer *timer;
+		while ((timer = *head) != NULL) {
+			coro_timer_unlink(w, timer);
+			timer->is_armed = false;
+			--w->count;
+			f(timer, arg);
+		}
+	}
+}
+
+uint64_t
+coro_timer_wheel_next(const struct coro_timer_wheel *w)
+{
+	if (w->count == 0)
+		return UINT64_MAX;
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < CORO_TIMER_LEVELS; ++level) {
+		uint64_t bits = w->occupied[level];
+		if (bits == 0)
+			continue;
+		int shift = CORO_TIMER_SLOT_BITS * level;
+		uint64_t block = w->tick >> shift;
+		/*
+		 * The slots after the current one are reached in this
+		 * round, the rest - in the next one.
+		 */
+		int rot = (block + 1) & (CORO_TIMER_SLOTS - 1);
+		if (rot != 0)
+			bits = (bits >> rot) | (bits << (64 - rot));
+		uint64_t at = (block + __builtin_ctzll(bits) + 1) << shift;
+		if (at < next)
+			next = at;
+	}
+	return next;
+}
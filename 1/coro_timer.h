@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Hierarchical timing wheel. The time is counted in wheel ticks,
+ * CORO_TIMER_TICK_NSEC each. Level 0 has a slot per tick for the
+ * next 64 ticks, each next level has slots 64 times wider. A
+ * timer is put into the lowest level, which can hold it, and is
+ * moved down by the levels, when the wheel reaches its slot. So
+ * adding and removing a timer is O(1) at any timer count, and
+ * each timer is moved at most once per level.
+ *
+ * The wheel is not thread-safe, the owner protects it.
+ */
+
+enum {
+	/** Bits of a slot index in a level. */
+	CORO_TIMER_SLOT_BITS = 6,
+	CORO_TIMER_SLOTS = 1 << CORO_TIMER_SLOT_BITS,
+	/** 6 levels of 64 slots cover 2^36 ticks, about 52 days. */
+	CORO_TIMER_LEVELS = 6,
+	/** A tick is 2^16 ns, about 65 us. */
+	CORO_TIMER_TICK_SHIFT = 16,
+	CORO_TIMER_TICK_NSEC = 1 << CORO_TIMER_TICK_SHIFT,
+};
+
+struct coro_timer {
+	/** Tick, when the timer expires. */
+	uint64_t expire;
+	/** Links in a slot list. */
+	struct coro_timer *next, **pprev;
+	/** Level and slot, where the timer is now. */
+	uint8_t level;
+	uint8_t slot;
+	/** True, if the timer is in a wheel. */
+	bool is_armed;
+};
+
+struct coro_timer_wheel {
+	/** The last processed tick. */
+	uint64_t tick;
+	/** Number of armed timers. */
+	int count;
+	/** Bit masks of non-empty slots of each level. */
+	uint64_t occupied[CORO_TIMER_LEVELS];
+	struct coro_timer *slots[CORO_TIMER_LEVELS][CORO_TIMER_SLOTS];
+};
+
+/** Called for each expired timer. It is already removed. */
+typedef void (*coro_timer_f)(struct coro_timer *timer, void *arg);
+
+/** Convert nanoseconds of CLOCK_MONOTONIC into wheel ticks, down. */
+static inline uint64_t
+coro_timer_tick(long long nsec)
+{
+	return (uint64_t)nsec >> CORO_TIMER_TICK_SHIFT;
+}
+
+/** Start an empty wheel at the given tick. */
+void
+coro_timer_wheel_create(struct coro_timer_wheel *w, uint64_t tick);
+
+/**
+ * Arm the timer to expire at the given tick. A tick, which has
+ * already been processed, means the next one.
+ */
+void
+coro_timer_add(struct coro_timer_wheel *w, struct coro_timer *timer,
+	       uint64_t expire);
+
+/** Disarm the timer. Does nothing, if it is not armed. */
+void
+coro_timer_remove(struct coro_timer_wheel *w, struct coro_timer *timer);
+
+/**
+ * Process all the ticks up to @a tick inclusive, and call @a f
+ * for each expired timer.
+ */
+void
+coro_timer_wheel_advance(struct coro_timer_wheel *w, uint64_t tick,
+			 coro_timer_f f, void *arg);
+
+/**
+ * The earliest tick, when the wheel should be advanced - a timer
+ * expires, or a higher level slot should be moved down. Not
+ * later than the nearest expiration. UINT64_MAX, if the wheel
+ * is empty.
+ */
+uint64_t
+coro_timer_wheel_next(const struct coro_timer_wheel *w);
@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "libcoro.h"
+#include "coro_io.h"
+#include "int_scan.h"
+#include "int_print.h"
+#include "int_merge.h"
+#include "int_sort.h"
+#include "sort_prof.h"
+#include "ext_sort.h"
+
+enum {
+	/** Most of the text, read from the input at once. */
+	EXT_TEXT_CHUNK_MAX = 1024 * 1024,
+	/** Numbers, merged at once before they are written. */
+	EXT_MERGE_CHUNK = 32 * 1024,
+	/**
+	 * Memory of a merge output: the chunk and the buffer of
+	 * int_printer, with a margin.
+	 */
+	EXT_MERGE_OUT_SIZE = 512 * 1024,
+	/** Least and most read-ahead buffer of one run. */
+	EXT_READ_AHEAD_MIN = 16 * 1024,
+	EXT_READ_AHEAD_MAX = 1024 * 1024,
+	/** Most runs merged at once, to keep the open files few. */
+	EXT_FAN_IN_MAX = 64,
+};
+
+/** Reader of a run file by blocks into a fixed buffer. */
+struct ext_reader {
+	int fd;
+	int *buf;
+	/** Buffer size in numbers. */
+	size_t capacity;
+	/** Numbers in the file, not read yet. */
+	size_t left;
+};
+
+struct ext_merge {
+	struct ext_reader *readers;
+	/** Error of a failed read, 0 if none. */
+	int error;
+};
+
+/**
+ * Big buffers are mapped directly, not malloc'ed, so unmapping
+ * returns them to the system for sure.
+ */
+static void *
+ext_map(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void
+ext_unmap(void *p, size_t size)
+{
+	if (p != NULL)
+		munmap(p, size);
+}
+
+/** Write all the bytes, retrying short writes. */
+static int
+ext_write_all(int fd, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = coro_write(fd, pos, size);
+		if (rc < 0)
+			return -1;
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/** Read exactly @a size bytes. EIO, if the file is shorter. */
+static int
+ext_read_all(int fd, void *buf, size_t size)
+{
+	char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = coro_read(fd, pos, size);
+		if (rc < 0)
+			return -1;
+		if (rc == 0) {
+			errno = EIO;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+void
+ext_run_list_create(struct ext_run_list *l)
+{
+	memset(l, 0, sizeof(*l));
+}
+
+static void
+ext_run_delete(struct ext_run *r)
+{
+	unlink(r->path);
+	free(r->path);
+}
+
+void
+ext_run_list_destroy(struct ext_run_list *l)
+{
+	for (int i = 0; i < l->count; ++i)
+		ext_run_delete(&l->runs[i]);
+	free(l->runs);
+	ext_run_list_create(l);
+}
+
+static int
+ext_run_list_add(struct ext_run_list *l, const struct ext_run *r)
+{
+	if (l->count == l->capacity) {
+		int capacity = l->capacity == 0 ? 16 : l->capacity * 2;
+		struct ext_run *runs =
+			realloc(l->runs, capacity * sizeof(runs[0]));
+		if (runs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		l->runs = runs;
+		l->capacity = capacity;
+	}
+	l->runs[l->count++] = *r;
+	return 0;
+}
+
+int
+ext_run_list_move(struct ext_run_list *dst, struct ext_run_list *src)
+{
+	int moved = 0;
+	for (; moved < src->count; ++moved) {
+		if (ext_run_list_add(dst, &src->runs[moved]) != 0)
+			break;
+	}
+	src->count -= moved;
+	memmove(src->runs, src->runs + moved,
+		src->count * sizeof(src->runs[0]));
+	if (src->count > 0)
+		return -1;
+	free(src->runs);
+	ext_run_list_create(src);
+	return 0;
+}
+
+/** Create a new temporary file for a run. Return its fd. */
+static int
+ext_run_open(struct ext_run *r)
+{
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == 0)
+		dir = "/tmp";
+	size_t size = strlen(dir) + sizeof("/sort_run_XXXXXX");
+	r->path = malloc(size);
+	if (r->path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(r->path, size, "%s/sort_run_XXXXXX", dir);
+	r->size = 0;
+	int fd = mkstemp(r->path);
+	if (fd < 0) {
+		int err = errno;
+		free(r->path);
+		errno = err;
+	}
+	return fd;
+}
+
+/** Account the time since the mark to the phase, if profiled. */
+static inline void
+ext_prof(struct sort_prof_time *phases, enum sort_phase phase,
+	 struct sort_prof_mark *mark)
+{
+	if (phases != NULL)
+		sort_prof_add(&phases[phase], mark);
+}
+
+/** Sort the numbers and write them into a new run. */
+static int
+ext_spill(int *data, size_t count, int *scratch, struct ext_run_list *runs,
+	  struct sort_prof_time *phases, struct sort_prof_mark *mark)
+{
+	ext_prof(phases, SORT_PHASE_PARSE, mark);
+	int_sort_ex(data, count, INT_SORT_AUTO, scratch);
+	ext_prof(phases, SORT_PHASE_SORT, mark);
+	struct ext_run r;
+	int fd = ext_run_open(&r);
+	if (fd < 0)
+		return -1;
+	r.size = count;
+	if (ext_write_all(fd, data, count * sizeof(data[0])) != 0) {
+		int err = errno;
+		close(fd);
+		ext_run_delete(&r);
+		errno = err;
+		return -1;
+	}
+	close(fd);
+	if (ext_run_list_add(runs, &r) != 0) {
+		ext_run_delete(&r);
+		errno = ENOMEM;
+		return -1;
+	}
+	ext_prof(phases, SORT_PHASE_WRITE, mark);
+	return 0;
+}
+
+int
+ext_sort_runs(const char *path, size_t budget, struct ext_run_list *runs,
+	      struct sort_prof_time *phases)
+{
+	struct sort_prof_mark mark;
+	if (phases != NULL)
+		sort_prof_mark(&mark);
+	if (budget < EXT_SORT_BUDGET_MIN)
+		budget = EXT_SORT_BUDGET_MIN;
+	/*
+	 * The budget is split into the text chunk, the numbers of
+	 * the current run, and the scratch of the sort, same size.
+	 * The input is read, not mapped, because mapped file pages
+	 * would count into RSS as well.
+	 */
+	size_t text_size = budget / 16;
+	if (text_size > EXT_TEXT_CHUNK_MAX)
+		text_size = EXT_TEXT_CHUNK_MAX;
+	/* Whole pages, so the numbers after the text are aligned. */
+	text_size &= ~(size_t)4095;
+	size_t capacity = (budget - text_size) / (2 * sizeof(int));
+	size_t map_size = text_size + 2 * capacity * sizeof(int);
+	char *text = ext_map(map_size);
+	if (text == NULL)
+		return -1;
+	int *data = (int *)(text + text_size);
+	int *scratch = data + capacity;
+
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		int err = errno;
+		ext_unmap(text, map_size);
+		errno = err;
+		return -1;
+	}
+	struct int_scanner s;
+	int_scanner_create(&s);
+	s.data = data;
+	s.capacity = capacity;
+	int rc = 0;
+	ssize_t size;
+	while ((size = coro_read(fd, text, text_size)) > 0) {
+		ext_prof(phases, SORT_PHASE_READ, &mark);
+		const char *pos = text;
+		while (size > 0) {
+			if (s.count == capacity) {
+				if (ext_spill(data, s.count, scratch, runs, phases, &mark) != 0)
+					goto fail;
+				s.count = 0;
+			}
+			/*
+			 * A number takes at least 2 bytes with the
+			 * separator, plus one more can be finished
+			 * from the previous piece. So the piece fits
+			 * the free space and the array never grows.
+			 */
+			size_t piece = 2 * (capacity - s.count) - 1;
+			if (piece > (size_t)size)
+				piece = size;
+			int_scanner_feed(&s, pos, piece);
+			pos += piece;
+			size -= piece;
+		}
+		coro_yield_if_expired();
+		ext_prof(phases, SORT_PHASE_PARSE, &mark);
+	}
+	if (size < 0)
+		goto fail;
+	if (s.count == capacity) {
+		if (ext_spill(data, s.count, scratch, runs, phases, &mark) != 0)
+			goto fail;
+		s.count = 0;
+	}
+	size_t count;
+	int_scanner_finish(&s, &count);
+	if (count > 0 && ext_spill(data, count, scratch, runs, phases, &mark) != 0)
+		goto fail;
+	goto out;
+fail:
+	rc = -1;
+out:;
+	int err = errno;
+	close(fd);
+	ext_unmap(text, map_size);
+	errno = err;
+	return rc;
+}
+
+static bool
+ext_merge_refill(void *ctx, int leaf, struct int_run *run)
+{
+	struct ext_merge *m = ctx;
+	struct ext_reader *r = &m->readers[leaf];
+	if (r->left == 0 || m->error != 0)
+		return false;
+	size_t count = r->left < r->capacity ? r->left : r->capacity;
+	if (ext_read_all(r->fd, r->buf, count * sizeof(r->buf[0])) != 0) {
+		m->error = errno;
+		return false;
+	}
+	r->left -= count;
+	run->data = r->buf;
+	run->size = count;
+	return true;
+}
+
+/**
+ * Merge @a count runs from @a first. The result goes to @a fd as
+ * text, or as raw numbers of a new run, if @a is_text is false.
+ */
+static int
+ext_merge_runs(const struct ext_run *first, int count, size_t budget, int fd,
+	       bool is_text)
+{
+	size_t read_ahead = budget > EXT_MERGE_OUT_SIZE ?
+			    (budget - EXT_MERGE_OUT_SIZE) / (count > 0 ? count : 1) :
+			    0;
+	if (read_ahead < EXT_READ_AHEAD_MIN)
+		read_ahead = EXT_READ_AHEAD_MIN;
+	if (read_ahead > EXT_READ_AHEAD_MAX)
+		read_ahead = EXT_READ_AHEAD_MAX;
+	size_t capacity = read_ahead / sizeof(int);
+	size_t map_size = (count * capacity + EXT_MERGE_CHUNK) * sizeof(int);
+	int *chunk = ext_map(map_size);
+	if (chunk == NULL)
+		return -1;
+
+	struct ext_merge m;
+	m.error = 0;
+	m.readers = calloc(count > 0 ? count : 1, sizeof(m.readers[0]));
+	struct int_run *runs = calloc(count > 0 ? count : 1, sizeof(runs[0]));
+	int rc = -1;
+	int opened = 0;
+	if (m.readers == NULL || runs == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (; opened < count; ++opened) {
+		struct ext_reader *r = &m.readers[opened];
+		r->fd = coro_open(first[opened].path, O_RDONLY, 0);
+		if (r->fd < 0)
+			goto out;
+		r->buf = chunk + EXT_MERGE_CHUNK + opened * capacity;
+		r->capacity = capacity;
+		r->left = first[opened].size;
+	}
+
+	/* Empty runs make the merger ask for the first blocks. */
+	struct int_merger merger;
+	if (int_merger_create_ex(&merger, runs, count, ext_merge_refill,
+				 &m) != 0)
+		goto out;
+	struct int_printer printer;
+	if (is_text)
+		int_printer_create(&printer, fd);
+	size_t size;
+	rc = 0;
+	while ((size = int_merger_next(&merger, chunk, EXT_MERGE_CHUNK)) > 0) {
+		if (is_text)
+			int_printer_put(&printer, chunk, size);
+		else if (ext_write_all(fd, chunk, size * sizeof(chunk[0])) != 0)
+			rc = -1;
+		if (rc != 0 || m.error != 0)
+			break;
+		coro_yield_if_expired();
+	}
+	if (is_text && int_printer_destroy(&printer) != 0)
+		rc = -1;
+	if (m.error != 0) {
+		errno = m.error;
+		rc = -1;
+	}
+	int_merger_destroy(&merger);
+out:;
+	int err = errno;
+	for (int i = 0; i < opened; ++i)
+		close(m.readers[i].fd);
+	free(runs);
+	free(m.readers);
+	ext_unmap(chunk, map_size);
+	errno = err;
+	return rc;
+}
+
+int
+ext_merge_text(struct ext_run_list *runs, size_t budget, int fd)
+{
+	if (budget < EXT_SORT_BUDGET_MIN)
+		budget = EXT_SORT_BUDGET_MIN;
+	int fan_in = (budget - EXT_MERGE_OUT_SIZE) / EXT_READ_AHEAD_MIN;
+	if (fan_in > EXT_FAN_IN_MAX)
+		fan_in = EXT_FAN_IN_MAX;
+	/*
+	 * Too many runs for one pass - merge the oldest ones into a
+	 * new run in the end of the list, until few enough are left.
+	 * Each number is rewritten once per log(runs, fan_in) passes.
+	 */
+	while (runs->count > fan_in) {
+		struct ext_run r;
+		int out = ext_run_open(&r);
+		if (out < 0)
+			return -1;
+		for (int i = 0; i < fan_in; ++i)
+			r.size += runs->runs[i].size;
+		if (ext_merge_runs(runs->runs, fan_in, budget, out, false) != 0) {
+			int err = errno;
+			close(out);
+			ext_run_delete(&r);
+			errno = err;
+			return -1;
+		}
+		close(out);
+		for (int i = 0; i < fan_in; ++i)
+			ext_run_delete(&runs->runs[i]);
+		runs->count -= fan_in;
+		memmove(runs->runs, runs->runs + fan_in,
+			runs->count * sizeof(runs->runs[0]));
+		if (ext_run_list_add(runs, &r) != 0) {
+			ext_run_delete(&r);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	return ext_merge_runs(runs->runs, runs->count, budget, fd, true);
+}
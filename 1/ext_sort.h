@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+
+struct sort_prof_time;
+
+/**
+ * External sort of text files with numbers, for the inputs not
+ * fitting into memory. The numbers are sorted by runs, which fit
+ * into a memory budget, and the runs are spilled into temporary
+ * files ($TMPDIR or /tmp) as raw ints. Then they are merged by a
+ * loser tree with a bounded read-ahead buffer per run. If there
+ * are too many runs for the budget, groups of them are merged
+ * into bigger runs first. All the big buffers are mapped and
+ * unmapped directly, so the memory returns to the system right
+ * away.
+ */
+
+enum {
+	/** Least budget of one sort or merge. */
+	EXT_SORT_BUDGET_MIN = 1024 * 1024,
+};
+
+/** Sorted run of numbers in a temporary file. */
+struct ext_run {
+	char *path;
+	/** Number count. */
+	size_t size;
+};
+
+struct ext_run_list {
+	struct ext_run *runs;
+	int count;
+	int capacity;
+};
+
+void
+ext_run_list_create(struct ext_run_list *l);
+
+/** Delete the temporary files of the runs and free the list. */
+void
+ext_run_list_destroy(struct ext_run_list *l);
+
+/**
+ * Move all the runs of @a src to the end of @a dst.
+ * @retval 0 Success.
+ * @retval -1 No memory, errno is set. The runs, which are not
+ *         moved, stay in @a src.
+ */
+int
+ext_run_list_move(struct ext_run_list *dst, struct ext_run_list *src);
+
+/**
+ * Parse the numbers of a text file, sort them by runs using at
+ * most @a budget bytes, and add the runs to the list. If @a phases
+ * is not NULL, the time of the read, parse, sort and write (of the
+ * runs) phases is added to it, indexed by enum sort_phase.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+ext_sort_runs(const char *path, size_t budget, struct ext_run_list *runs,
+	      struct sort_prof_time *phases);
+
+/**
+ * Merge the runs into text, written to @a fd, using at most
+ * @a budget bytes. The runs can be replaced with fewer bigger
+ * ones on the way, and are left in the list.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+ext_merge_text(struct ext_run_list *runs, size_t budget, int fd);
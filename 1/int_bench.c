@@ -0,0 +1,138 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "int_scan.h"
+#include "int_print.h"
+#include "int_sort.h"
+
+/**
+ * Throughput of the integer text format: int_printer against
+ * fprintf() and int_scanner against strtol(). Both write into
+ * /dev/null or parse from memory, so only the formatting is
+ * measured. Then the sort algorithms are compared on arrays of
+ * different sizes. Run with 'make bench'.
+ */
+
+enum {
+	/** Numbers in the test array. */
+	BENCH_COUNT = 20 * 1000 * 1000,
+	/** Values are in [-BENCH_RANGE, BENCH_RANGE]. */
+	BENCH_RANGE = 100 * 1000 * 1000,
+	/** Each sort size is repeated to sort that many numbers. */
+	BENCH_SORT_TOTAL = 16 * 1024 * 1024,
+};
+
+static long long
+bench_now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *name, long long bytes, long long nsec)
+{
+	printf("%-22s %8.1lf MB/s %8.1lf ns/number\n", name,
+	       bytes * 1e3 / nsec, (double)nsec / BENCH_COUNT);
+}
+
+/** ns per number of each algorithm on arrays of growing size. */
+static void
+bench_sort(const int *values)
+{
+	int *arr = malloc(BENCH_COUNT * sizeof(arr[0]));
+	printf("%10s", "sort size");
+	for (int a = INT_SORT_AUTO + 1; a < int_sort_algo_MAX; ++a)
+		printf(" %10s", int_sort_algo_strs[a]);
+	printf("   ns/number, auto is %s\n",
+	       int_sort_algo_strs[int_sort_algo_choose(BENCH_COUNT)]);
+	for (int size = 256; size <= BENCH_COUNT; size *= 8) {
+		int repeat = size < BENCH_SORT_TOTAL ?
+			     BENCH_SORT_TOTAL / size : 1;
+		printf("%10d", size);
+		for (int a = INT_SORT_AUTO + 1; a < int_sort_algo_MAX; ++a) {
+			long long nsec = 0;
+			for (int i = 0; i < repeat; ++i) {
+				memcpy(arr, values, size * sizeof(arr[0]));
+				long long start = bench_now_nsec();
+				int_sort(arr, size, a);
+				nsec += bench_now_nsec() - start;
+			}
+			printf(" %10.1lf", (double)nsec / repeat / size);
+		}
+		printf("\n");
+	}
+	free(arr);
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	int *values = malloc(BENCH_COUNT * sizeof(values[0]));
+	srand(1);
+	for (int i = 0; i < BENCH_COUNT; ++i)
+		values[i] = rand() % (2 * BENCH_RANGE + 1) - BENCH_RANGE;
+
+	/* The text for the parsers, same as the printers produce. */
+	size_t text_size = 0;
+	char *text = malloc((size_t)BENCH_COUNT * 12 + 1);
+	for (int i = 0; i < BENCH_COUNT; ++i)
+		text_size += sprintf(text + text_size, "%d ", values[i]);
+
+	FILE *f = fopen("/dev/null", "w");
+	long long start = bench_now_nsec();
+	for (int i = 0; i < BENCH_COUNT; ++i)
+		fprintf(f, "%d ", values[i]);
+	fflush(f);
+	bench_report("fprintf", text_size, bench_now_nsec() - start);
+	fclose(f);
+
+	int fd = open("/dev/null", O_WRONLY);
+	struct int_printer printer;
+	start = bench_now_nsec();
+	int_printer_create(&printer, fd);
+	int_printer_put(&printer, values, BENCH_COUNT);
+	int_printer_destroy(&printer);
+	bench_report("int_printer", text_size, bench_now_nsec() - start);
+	close(fd);
+
+	start = bench_now_nsec();
+	char *pos = text, *end;
+	long long sum = 0;
+	for (long v = strtol(pos, &end, 10); end != pos;
+	     v = strtol(pos, &end, 10)) {
+		sum += v;
+		pos = end;
+	}
+	bench_report("strtol", text_size, bench_now_nsec() - start);
+
+	struct int_scanner scanner;
+	start = bench_now_nsec();
+	int_scanner_create(&scanner);
+	int_scanner_feed(&scanner, text, text_size);
+	size_t count;
+	int *parsed = int_scanner_finish(&scanner, &count);
+	bench_report("int_scanner", text_size, bench_now_nsec() - start);
+
+	if (count != BENCH_COUNT ||
+	    memcmp(parsed, values, count * sizeof(values[0])) != 0) {
+		printf("Error: int_scanner result is wrong\n");
+		return 1;
+	}
+	/* Keep the strtol loop from being thrown away. */
+	if (sum == 1)
+		printf("\n");
+	free(parsed);
+	free(text);
+
+	bench_sort(values);
+	free(values);
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "coro_io.h"
+#include "int_bin.h"
+
+enum {
+	INT_BIN_BUF_SIZE = 256 * 1024,
+	/** Longest varint of a 32-bit difference. */
+	INT_BIN_VARINT_MAX = 5,
+};
+
+static const uint64_t INT_BIN_CHECKSUM_SEED = 0xcbf29ce484222325ULL;
+
+static inline uint64_t
+int_bin_checksum_add(uint64_t h, int v)
+{
+	return (h ^ (uint32_t)v) * 0x100000001b3ULL;
+}
+
+/** Write the whole buffer, retrying short writes. */
+static int
+int_bin_write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = coro_write(fd, data, size);
+		if (rc < 0)
+			return -1;
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static void
+int_bin_writer_flush(struct int_bin_writer *w)
+{
+	if (w->error == 0 && int_bin_write_all(w->fd, w->buf, w->pos) != 0)
+		w->error = errno;
+	w->header.payload_size += w->pos;
+	w->pos = 0;
+}
+
+void
+int_bin_writer_create(struct int_bin_writer *w, int fd,
+		      enum int_bin_encoding encoding)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->encoding = encoding;
+	w->size = INT_BIN_BUF_SIZE;
+	w->buf = malloc(w->size);
+	if (w->buf == NULL) {
+		w->size = 0;
+		w->error = ENOMEM;
+	}
+	memcpy(w->header.magic, INT_BIN_MAGIC, sizeof(w->header.magic));
+	w->header.encoding = encoding;
+	w->header.flags = INT_BIN_SORTED;
+	w->header.checksum = INT_BIN_CHECKSUM_SEED;
+	w->prev = INT_MIN;
+	if (w->error == 0 && int_bin_write_all(fd, (const char *)&w->header,
+					       sizeof(w->header)) != 0)
+		w->error = errno;
+}
+
+void
+int_bin_writer_put(struct int_bin_writer *w, const int *values, size_t count)
+{
+	if (w->buf == NULL)
+		return;
+	uint64_t checksum = w->header.checksum;
+	int prev = w->prev;
+	bool is_sorted = (w->header.flags & INT_BIN_SORTED) != 0;
+	for (size_t i = 0; i < count; ++i) {
+		int v = values[i];
+		if (w->size - w->pos < INT_BIN_VARINT_MAX)
+			int_bin_writer_flush(w);
+		checksum = int_bin_checksum_add(checksum, v);
+		if (v < prev) {
+			is_sorted = false;
+			if (w->encoding == INT_BIN_DELTA) {
+				if (w->error == 0)
+					w->error = EINVAL;
+				break;
+			}
+		}
+		if (w->encoding == INT_BIN_FIXED) {
+			memcpy(w->buf + w->pos, &v, sizeof(v));
+			w->pos += sizeof(v);
+		} else {
+			uint32_t delta = (uint32_t)v - (uint32_t)prev;
+			while (delta >= 0x80) {
+				w->buf[w->pos++] = (char)(delta | 0x80);
+				delta >>= 7;
+			}
+			w->buf[w->pos++] = (char)delta;
+		}
+		prev = v;
+	}
+	w->header.count += count;
+	w->header.checksum = checksum;
+	w->prev = prev;
+	if (! is_sorted)
+		w->header.flags &= ~INT_BIN_SORTED;
+}
+
+int
+int_bin_writer_destroy(struct int_bin_writer *w)
+{
+	int_bin_writer_flush(w);
+	free(w->buf);
+	w->buf = NULL;
+	if (w->error == 0 && (lseek(w->fd, 0, SEEK_SET) != 0 ||
+			      int_bin_write_all(w->fd, (const char *)&w->header,
+						sizeof(w->header)) != 0))
+		w->error = errno;
+	if (w->error != 0) {
+		errno = w->error;
+		return -1;
+	}
+	return 0;
+}
+
+bool
+int_bin_is_run(const void *data, size_t size)
+{
+	return size >= sizeof(struct int_bin_header) &&
+	       memcmp(data, INT_BIN_MAGIC, sizeof(INT_BIN_MAGIC) - 1) == 0;
+}
+
+int
+int_bin_reader_create(struct int_bin_reader *r, const void *data,
+		      size_t size)
+{
+	memset(r, 0, sizeof(*r));
+	if (! int_bin_is_run(data, size)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&r->header, data, sizeof(r->header));
+	const struct int_bin_header *h = &r->header;
+	/* Each number takes at least a byte, 4 when fixed. */
+	if (h->encoding >= int_bin_encoding_MAX ||
+	    h->payload_size != size - sizeof(*h) ||
+	    h->count > h->payload_size ||
+	    (h->encoding == INT_BIN_FIXED &&
+	     h->payload_size != h->count * sizeof(int))) {
+		errno = EINVAL;
+		return -1;
+	}
+	r->pos = (const char *)data + sizeof(*h);
+	r->end = r->pos + h->payload_size;
+	r->left = h->count;
+	r->prev = INT_MIN;
+	r->checksum = INT_BIN_CHECKSUM_SEED;
+	r->is_sorted = true;
+	return 0;
+}
+
+size_t
+int_bin_reader_next(struct int_bin_reader *r, int *out, size_t limit)
+{
+	if (limit > r->left)
+		limit = r->left;
+	uint64_t checksum = r->checksum;
+	bool is_sorted = r->is_sorted;
+	size_t count = 0;
+	if (r->header.encoding == INT_BIN_FIXED) {
+		memcpy(out, r->pos, limit * sizeof(int));
+		r->pos += limit * sizeof(int);
+		int prev = r->prev;
+		for (; count < limit; ++count) {
+			checksum = int_bin_checksum_add(checksum, out[count]);
+			is_sorted &= out[count] >= prev;
+			prev = out[count];
+		}
+		r->prev = prev;
+	} else {
+		const unsigned char *pos = (const unsigned char *)r->pos;
+		const unsigned char *end = (const unsigned char *)r->end;
+		uint32_t prev = (uint32_t)r->prev;
+		for (; count < limit; ++count) {
+			uint32_t delta = 0;
+			int shift = 0;
+			while (pos < end && (*pos & 0x80) != 0 && shift < 28) {
+				delta |= (uint32_t)(*pos++ & 0x7f) << shift;
+				shift += 7;
+			}
+			/* Truncated - the check is going to fail. */
+			if (pos == end)
+				break;
+			delta |= (uint32_t)*pos++ << shift;
+			/* A wrapped delta goes down. */
+			is_sorted &= (int)(prev + delta) >= (int)prev;
+			prev += delta;
+			out[count] = (int)prev;
+			checksum = int_bin_checksum_add(checksum, out[count]);
+		}
+		r->pos = (const char *)pos;
+		r->prev = (int)prev;
+	}
+	r->checksum = checksum;
+	r->is_sorted = is_sorted;
+	r->left -= count;
+	return count;
+}
+
+int
+int_bin_reader_check(const struct int_bin_reader *r)
+{
+	if (r->left != 0 || r->pos != r->end ||
+	    r->checksum != r->header.checksum ||
+	    ((r->header.flags & INT_BIN_SORTED) != 0 && ! r->is_sorted)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
+}
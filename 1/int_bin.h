@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Binary file format of integer runs, a compact alternative to the
+ * text. The file is a header and the numbers, either as fixed
+ * 4-byte ints or, for sorted runs, as LEB128 varints of the
+ * differences between the neighbours. The header has the count and
+ * a checksum of the numbers. The byte order is the one of the host
+ * (little-endian everywhere this is built).
+ *
+ * A fixed-width file can be mapped and used right away, with no
+ * parsing at all. A delta one takes 1-2 bytes per number on dense
+ * sorted data instead of 4 and is decoded by a single pass.
+ */
+
+enum int_bin_encoding {
+	INT_BIN_FIXED,
+	/** Non-decreasing numbers only. */
+	INT_BIN_DELTA,
+	int_bin_encoding_MAX,
+};
+
+enum int_bin_flag {
+	/** The numbers are non-decreasing. */
+	INT_BIN_SORTED = 1,
+};
+
+/** "intrun" and the format version. */
+#define INT_BIN_MAGIC "\x7fintrun\x01"
+
+struct int_bin_header {
+	char magic[8];
+	uint32_t encoding;
+	uint32_t flags;
+	uint64_t count;
+	/** Bytes of the numbers after the header. */
+	uint64_t payload_size;
+	uint64_t checksum;
+};
+
+/**
+ * Buffered writer of a binary run. The header is written in the
+ * beginning as a placeholder and is rewritten when the writer is
+ * destroyed, so the file should be seekable and open at offset 0.
+ * The writes go via coro_write().
+ */
+struct int_bin_writer {
+	int fd;
+	enum int_bin_encoding encoding;
+	char *buf;
+	size_t size;
+	size_t pos;
+	struct int_bin_header header;
+	int prev;
+	/** Error of a failed write or put, 0 if none. Sticky. */
+	int error;
+};
+
+/**
+ * Start a run in @a fd. If there is no memory for the buffer, the
+ * error is set to ENOMEM and nothing is written.
+ */
+void
+int_bin_writer_create(struct int_bin_writer *w, int fd,
+		      enum int_bin_encoding encoding);
+
+/**
+ * Append numbers. INT_BIN_DELTA fails with EINVAL, if they are
+ * not sorted.
+ */
+void
+int_bin_writer_put(struct int_bin_writer *w, const int *values, size_t count);
+
+/**
+ * Write out the rest and the final header, free the buffer. The
+ * file is not closed.
+ * @retval 0 Success.
+ * @retval -1 Any put or write failed, errno is set.
+ */
+int
+int_bin_writer_destroy(struct int_bin_writer *w);
+
+/** Reader of a binary run in memory, a mapped file for example. */
+struct int_bin_reader {
+	struct int_bin_header header;
+	const char *pos;
+	const char *end;
+	/** Numbers not read yet. */
+	uint64_t left;
+	int prev;
+	uint64_t checksum;
+	/**
+	 * True, while the numbers read are non-decreasing. The
+	 * INT_BIN_SORTED flag is not in the checksum, so it is
+	 * checked against this.
+	 */
+	bool is_sorted;
+};
+
+/** True, if the data starts with the binary run magic. */
+bool
+int_bin_is_run(const void *data, size_t size);
+
+/**
+ * Start reading the run in @a data. It is not copied. The count
+ * in the header is checked to fit the payload, so it can be used
+ * to size the output.
+ * @retval 0 Success.
+ * @retval -1 The header is invalid, errno is EINVAL.
+ */
+int
+int_bin_reader_create(struct int_bin_reader *r, const void *data,
+		      size_t size);
+
+/**
+ * Read the next up to @a limit numbers into @a out. Return how
+ * many were read, 0 at the end. Check the result with
+ * int_bin_reader_check() at the end.
+ */
+size_t
+int_bin_reader_next(struct int_bin_reader *r, int *out, size_t limit);
+
+/**
+ * Check, that all the numbers were read and match the checksum,
+ * and that they are sorted, if the header says so.
+ * @retval 0 Success.
+ * @retval -1 The file is damaged, errno is EBADMSG.
+ */
+int
+int_bin_reader_check(const struct int_bin_reader *r);
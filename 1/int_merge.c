@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "int_merge.h"
+
+static inline int64_t
+int_merger_key(struct int_merger *m, int leaf)
+{
+	struct int_run *r = &m->runs[leaf];
+	if (m->pos[leaf] < r->size)
+		return r->data[m->pos[leaf]];
+	if (m->refill == NULL || leaf >= m->run_count)
+		return INT64_MAX;
+	do {
+		if (! m->refill(m->refill_ctx, leaf, r))
+			return INT64_MAX;
+	} while (r->size == 0);
+	m->pos[leaf] = 0;
+	return r->data[0];
+}
+
+/** Play the matches of the subtree, return the winner. */
+static int
+int_merger_build(struct int_merger *m, int node)
+{
+	if (node >= m->leaf_count)
+		return node - m->leaf_count;
+	int l = int_merger_build(m, 2 * node);
+	int r = int_merger_build(m, 2 * node + 1);
+	if (m->keys[r] < m->keys[l]) {
+		m->tree[node] = l;
+		return r;
+	}
+	m->tree[node] = r;
+	return l;
+}
+
+int
+int_merger_create(struct int_merger *m, const struct int_run *runs,
+		  int count)
+{
+	return int_merger_create_ex(m, runs, count, NULL, NULL);
+}
+
+int
+int_merger_create_ex(struct int_merger *m, const struct int_run *runs,
+		     int count, int_merger_refill_f refill, void *refill_ctx)
+{
+	int leaf_count = 1;
+	while (leaf_count < count)
+		leaf_count *= 2;
+	m->leaf_count = leaf_count;
+	m->run_count = count;
+	m->runs = calloc(leaf_count, sizeof(m->runs[0]));
+	m->pos = calloc(leaf_count, sizeof(m->pos[0]));
+	m->keys = malloc(leaf_count * sizeof(m->keys[0]));
+	m->tree = malloc(leaf_count * sizeof(m->tree[0]));
+	if (m->runs == NULL || m->pos == NULL || m->keys == NULL ||
+	    m->tree == NULL) {
+		free(m->runs);
+		free(m->pos);
+		free(m->keys);
+		free(m->tree);
+		errno = ENOMEM;
+		return -1;
+	}
+	m->refill = refill;
+	m->refill_ctx = refill_ctx;
+	for (int i = 0; i < count; ++i)
+		m->runs[i] = runs[i];
+	for (int i = 0; i < leaf_count; ++i)
+		m->keys[i] = int_merger_key(m, i);
+	m->tree[0] = int_merger_build(m, 1);
+	return 0;
+}
+
+void
+int_merger_destroy(struct int_merger *m)
+{
+	free(m->runs);
+	free(m->pos);
+	free(m->keys);
+	free(m->tree);
+}
+
+size_t
+int_merger_next(struct int_merger *m, int *out, size_t limit)
+{
+	int *tree = m->tree;
+	int64_t *keys = m->keys;
+	int winner = tree[0];
+	size_t n = 0;
+	while (n < limit && keys[winner] != INT64_MAX) {
+		out[n++] = (int)keys[winner];
+		++m->pos[winner];
+		int64_t key = int_merger_key(m, winner);
+		keys[winner] = key;
+		/*
+		 * Only the path from the winner's leaf to the root
+		 * has changed. It meets the losers of the previous
+		 * round there.
+		 */
+		for (int node = (winner + m->leaf_count) / 2; node > 0;
+		     node /= 2) {
+			int loser = tree[node];
+			if (keys[loser] < key) {
+				tree[node] = winner;
+				winner = loser;
+				key = keys[loser];
+			}
+		}
+	}
+	tree[0] = winner;
+	return n;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Sorted array of integers, one input of a merge. */
+struct int_run {
+	const int *data;
+	size_t size;
+};
+
+/**
+ * Give the next block of the run @a leaf, when the previous one is
+ * over. It is stored into @a run. Return false, if the run has
+ * ended.
+ */
+typedef bool (*int_merger_refill_f)(void *ctx, int leaf, struct int_run *run);
+
+/**
+ * K-way merge of sorted runs on a loser tree. Each output number
+ * costs log2(K) compares against the losers on the path of the
+ * previous winner only. The output is produced by bounded chunks,
+ * so the merge can be streamed into a writer and a coroutine can
+ * yield between the chunks.
+ */
+struct int_merger {
+	/** Number of leaves, a power of 2, >= run count. */
+	int leaf_count;
+	int run_count;
+	struct int_run *runs;
+	/** Position of the next number in each run. */
+	size_t *pos;
+	/**
+	 * Current number of each leaf. INT64_MAX, when the run is
+	 * over or there is no run.
+	 */
+	int64_t *keys;
+	/**
+	 * tree[0] is the leaf with the least number, tree[i] for
+	 * i > 0 is the leaf, which lost in the node i.
+	 */
+	int *tree;
+	/** Source of the next blocks of the runs. NULL, if none. */
+	int_merger_refill_f refill;
+	void *refill_ctx;
+};
+
+/**
+ * Start merging @a count runs. They are not copied and should
+ * live until the merge is over.
+ * @retval 0 Success.
+ * @retval -1 No memory, errno is set. The merger is not created.
+ */
+int
+int_merger_create(struct int_merger *m, const struct int_run *runs,
+		  int count);
+
+/**
+ * Same as int_merger_create(), but the runs are given by blocks.
+ * When a block is over, @a refill is called for the next one, so
+ * the runs can be streamed from files.
+ */
+int
+int_merger_create_ex(struct int_merger *m, const struct int_run *runs,
+		     int count, int_merger_refill_f refill, void *refill_ctx);
+
+void
+int_merger_destroy(struct int_merger *m);
+
+/**
+ * Write the next up to @a limit numbers into @a out. Return how
+ * many were written, 0 when all the runs are over.
+ */
+size_t
+int_merger_next(struct int_merger *m, int *out, size_t limit);
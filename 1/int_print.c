@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "coro_io.h"
+#include "int_print.h"
+
+enum {
+	INT_PRINT_BUF_SIZE = 256 * 1024,
+	/** The longest number with a separator: "-2147483648 ". */
+	INT_PRINT_MAX_LEN = 12,
+};
+
+/** "00", "01", ... "99" */
+static const char int_print_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint32_t int_print_pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000,
+};
+
+/**
+ * Number of decimal digits. log10 is estimated from the bit
+ * length as log2 * 1233 / 4096 and corrected by one compare.
+ */
+static inline unsigned
+int_print_digit_count(uint32_t v)
+{
+	v |= 1;
+	unsigned t = ((32 - __builtin_clz(v)) * 1233) >> 12;
+	return t + 1 - (v < int_print_pow10[t]);
+}
+
+/** Print the number and a space, return the end. */
+static inline char *
+int_print_one(char *out, int value)
+{
+	uint32_t v = value;
+	if (value < 0) {
+		*out++ = '-';
+		v = -v;
+	}
+	char *end = out + int_print_digit_count(v);
+	char *p = end;
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, int_print_pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, int_print_pairs + v * 2, 2);
+	} else {
+		*--p = '0' + v;
+	}
+	*end = ' ';
+	return end + 1;
+}
+
+void
+int_printer_create(struct int_printer *p, int fd)
+{
+	p->fd = fd;
+	p->buf = malloc(INT_PRINT_BUF_SIZE);
+	p->size = INT_PRINT_BUF_SIZE;
+	p->pos = 0;
+	p->error = 0;
+	if (p->buf == NULL) {
+		p->size = 0;
+		p->error = ENOMEM;
+	}
+}
+
+void
+int_printer_put(struct int_printer *p, const int *values, size_t count)
+{
+	if (p->buf == NULL)
+		return;
+	char *out = p->buf + p->pos;
+	char *limit = p->buf + p->size - INT_PRINT_MAX_LEN;
+	for (size_t i = 0; i < count; ++i) {
+		if (out > limit) {
+			p->pos = out - p->buf;
+			int_printer_flush(p);
+			out = p->buf;
+		}
+		out = int_print_one(out, values[i]);
+	}
+	p->pos = out - p->buf;
+}
+
+int
+int_printer_flush(struct int_printer *p)
+{
+	size_t done = 0;
+	while (done < p->pos && p->error == 0) {
+		ssize_t rc = coro_write(p->fd, p->buf + done, p->pos - done);
+		if (rc > 0)
+			done += rc;
+		else if (rc == 0)
+			p->error = EIO;
+		else if (errno != EINTR)
+			p->error = errno;
+	}
+	p->pos = 0;
+	if (p->error == 0)
+		return 0;
+	errno = p->error;
+	return -1;
+}
+
+int
+int_printer_destroy(struct int_printer *p)
+{
+	int rc = int_printer_flush(p);
+	int error = errno;
+	free(p->buf);
+	p->buf = NULL;
+	errno = error;
+	return rc;
+}
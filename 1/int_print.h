@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Buffered writer of integers as text, each followed by a space.
+ * Numbers are converted two digits at once via a lookup table
+ * into a big buffer, which is written out by one system call when
+ * full. The writes go via coro_write(), so only the calling
+ * coroutine waits for them.
+ */
+struct int_printer {
+	int fd;
+	char *buf;
+	size_t size;
+	/** Number of bytes in the buffer. */
+	size_t pos;
+	/** Error of a failed flush, 0 if none. Sticky. */
+	int error;
+};
+
+/**
+ * Create a printer into @a fd. If there is no memory for the
+ * buffer, the error is set to ENOMEM and nothing is written.
+ */
+void
+int_printer_create(struct int_printer *p, int fd);
+
+/** Append numbers to the buffer, flush it when it is full. */
+void
+int_printer_put(struct int_printer *p, const int *values, size_t count);
+
+/**
+ * Write out the buffered text.
+ * @retval 0 Success.
+ * @retval -1 Any write failed, errno is set.
+ */
+int
+int_printer_flush(struct int_printer *p);
+
+/**
+ * Flush and free the buffer. The file is not closed. The result
+ * is the same as of int_printer_flush().
+ */
+int
+int_printer_destroy(struct int_printer *p);
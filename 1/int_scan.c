@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "int_scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define INT_SCAN_X86 1
+#endif
+
+enum {
+	/** Number of bytes, classified at once. */
+	INT_SCAN_BLOCK = 32,
+	INT_SCAN_CAPACITY_MIN = 1024,
+};
+
+typedef void (*int_scanner_feed_f)(struct int_scanner *s, const char *text,
+				   size_t size);
+
+/** Feed implementation for this CPU. */
+static int_scanner_feed_f int_scanner_feed_impl = NULL;
+
+static void
+int_scanner_push(struct int_scanner *s)
+{
+	if (s->count == s->capacity) {
+		size_t capacity = s->capacity < INT_SCAN_CAPACITY_MIN ?
+				  INT_SCAN_CAPACITY_MIN : s->capacity * 2;
+		int *data = realloc(s->data, capacity * sizeof(data[0]));
+		if (data == NULL) {
+			s->is_out_of_memory = true;
+			s->value = 0;
+			s->is_in_number = false;
+			return;
+		}
+		s->data = data;
+		s->capacity = capacity;
+	}
+	unsigned long long v = s->is_negative ? -s->value : s->value;
+	s->data[s->count++] = (int)v;
+	s->value = 0;
+	s->is_in_number = false;
+}
+
+static inline void
+int_scanner_add_digits(struct int_scanner *s, const char *digits, unsigned n)
+{
+	unsigned long long v = s->value;
+	for (unsigned i = 0; i < n; ++i)
+		v = v * 10 + (digits[i] - '0');
+	s->value = v;
+}
+
+/**
+ * Convert up to 8 digits at once. The digits are loaded as one
+ * word, which is shifted so the bytes out of the number become
+ * leading zeros. Then the adjacent digits, pairs, and quads are
+ * combined by multiplications.
+ */
+static inline unsigned long long
+int_scan_8_digits(const char *digits, unsigned n)
+{
+	uint64_t v;
+	memcpy(&v, digits, sizeof(v));
+	v <<= 8 * (8 - n);
+	v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	return ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+
+/**
+ * Parse one block of @a len <= INT_SCAN_BLOCK bytes. Bit i of
+ * @a digits is set, if block[i] is a digit. The numbers are
+ * found as the runs of set bits.
+ */
+static inline __attribute__((always_inline)) void
+int_scanner_block(struct int_scanner *s, const char *block, unsigned len,
+		  uint32_t digits)
+{
+	uint32_t rest = digits;
+	if (s->is_in_number) {
+		/* Continue the number from the previous block. */
+		unsigned n = digits == UINT32_MAX ? 32 : __builtin_ctz(~digits);
+		int_scanner_add_digits(s, block, n);
+		if (n == len)
+			goto end;
+		int_scanner_push(s);
+		rest &= UINT32_MAX << n;
+	}
+	while (rest != 0) {
+		unsigned start = __builtin_ctz(rest);
+		uint32_t after = ~(rest >> start);
+		unsigned n = after == 0 ? 32 : __builtin_ctz(after);
+		s->is_negative = start > 0 ? block[start - 1] == '-' :
+				 s->is_minus_last;
+		/* The block is readable up to its full size. */
+		if (n <= 8 && start + 8 <= INT_SCAN_BLOCK)
+			s->value = int_scan_8_digits(block + start, n);
+		else
+			int_scanner_add_digits(s, block + start, n);
+		if (start + n == len) {
+			s->is_in_number = true;
+			goto end;
+		}
+		int_scanner_push(s);
+		rest &= UINT32_MAX << (start + n);
+	}
+end:
+	s->is_minus_last = block[len - 1] == '-';
+}
+
+static inline uint32_t
+int_scan_digits_generic(const char *p)
+{
+	uint32_t mask = 0;
+	for (int i = 0; i < INT_SCAN_BLOCK; ++i)
+		mask |= (uint32_t)((unsigned char)(p[i] - '0') <= 9) << i;
+	return mask;
+}
+
+/**
+ * The last incomplete block is copied and padded with separators,
+ * which are cut off from the digits mask.
+ */
+static void
+int_scanner_tail(struct int_scanner *s, const char *text, size_t size)
+{
+	if (size == 0)
+		return;
+	char block[INT_SCAN_BLOCK];
+	memset(block, ' ', sizeof(block));
+	memcpy(block, text, size);
+	uint32_t digits = int_scan_digits_generic(block) &
+			  ((UINT32_C(1) << size) - 1);
+	int_scanner_block(s, block, size, digits);
+}
+
+#if ! INT_SCAN_X86
+
+static void
+int_scanner_feed_generic(struct int_scanner *s, const char *text,
+			 size_t size)
+{
+	size_t i = 0;
+	for (; i + INT_SCAN_BLOCK <= size; i += INT_SCAN_BLOCK) {
+		int_scanner_block(s, text + i, INT_SCAN_BLOCK,
+				  int_scan_digits_generic(text + i));
+	}
+	int_scanner_tail(s, text + i, size - i);
+}
+
+#else /* INT_SCAN_X86 */
+
+/*
+ * A byte is a digit, if (byte - '0') as unsigned is <= 9. SIMD
+ * has no unsigned compare, but min(x, 9) == x is the same.
+ */
+
+static inline uint32_t
+int_scan_digits_sse2(const char *p)
+{
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	__m128i lo = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+	__m128i hi = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+				  zero);
+	lo = _mm_cmpeq_epi8(_mm_min_epu8(lo, nine), lo);
+	hi = _mm_cmpeq_epi8(_mm_min_epu8(hi, nine), hi);
+	return (uint32_t)_mm_movemask_epi8(lo) |
+	       (uint32_t)_mm_movemask_epi8(hi) << 16;
+}
+
+static void
+int_scanner_feed_sse2(struct int_scanner *s, const char *text, size_t size)
+{
+	size_t i = 0;
+	for (; i + INT_SCAN_BLOCK <= size; i += INT_SCAN_BLOCK) {
+		int_scanner_block(s, text + i, INT_SCAN_BLOCK,
+				  int_scan_digits_sse2(text + i));
+	}
+	int_scanner_tail(s, text + i, size - i);
+}
+
+static inline __attribute__((target("avx2"))) uint32_t
+int_scan_digits_avx2(const char *p)
+{
+	__m256i v = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)p),
+				    _mm256_set1_epi8('0'));
+	v = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(9)), v);
+	return (uint32_t)_mm256_movemask_epi8(v);
+}
+
+static __attribute__((target("avx2"))) void
+int_scanner_feed_avx2(struct int_scanner *s, const char *text, size_t size)
+{
+	size_t i = 0;
+	for (; i + INT_SCAN_BLOCK <= size; i += INT_SCAN_BLOCK) {
+		int_scanner_block(s, text + i, INT_SCAN_BLOCK,
+				  int_scan_digits_avx2(text + i));
+	}
+	int_scanner_tail(s, text + i, size - i);
+}
+
+#endif /* INT_SCAN_X86 */
+
+void
+int_scanner_create(struct int_scanner *s)
+{
+	memset(s, 0, sizeof(*s));
+	if (__atomic_load_n(&int_scanner_feed_impl, __ATOMIC_RELAXED) != NULL)
+		return;
+	/*
+	 * Threads can get here at once. They all choose the same,
+	 * so the choice just should be stored atomically.
+	 */
+	int_scanner_feed_f impl;
+#if INT_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		impl = int_scanner_feed_avx2;
+	else
+		impl = int_scanner_feed_sse2;
+#else
+	impl = int_scanner_feed_generic;
+#endif
+	__atomic_store_n(&int_scanner_feed_impl, impl, __ATOMIC_RELAXED);
+}
+
+void
+int_scanner_feed(struct int_scanner *s, const char *text, size_t size)
+{
+	__atomic_load_n(&int_scanner_feed_impl, __ATOMIC_RELAXED)(s, text, size);
+}
+
+int *
+int_scanner_finish(struct int_scanner *s, size_t *count)
+{
+	if (s->is_in_number)
+		int_scanner_push(s);
+	if (s->is_out_of_memory) {
+		free(s->data);
+		s->data = NULL;
+		s->count = 0;
+	}
+	*count = s->count;
+	int *data = s->data;
+	s->data = NULL;
+	s->count = s->capacity = 0;
+	return data;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Streaming parser of whitespace-separated decimal integers. The
+ * text is fed by chunks of any size, numbers can be split between
+ * them. Digits are found by SIMD - AVX2 or SSE2 depending on the
+ * CPU - 32 bytes at once, so the text is read in a single pass.
+ * Any byte except digits and '-' before a number is a separator.
+ * The numbers should fit into int.
+ */
+struct int_scanner {
+	/** Numbers parsed so far. */
+	int *data;
+	size_t count;
+	size_t capacity;
+	/** The number, which is not finished yet. */
+	unsigned long long value;
+	bool is_negative;
+	/** True, if the last chunk has ended inside a number. */
+	bool is_in_number;
+	/** True, if the last chunk has ended with '-'. */
+	bool is_minus_last;
+	/** True, if the array could not grow. The numbers are lost. */
+	bool is_out_of_memory;
+};
+
+void
+int_scanner_create(struct int_scanner *s);
+
+/** Parse the next chunk of text. */
+void
+int_scanner_feed(struct int_scanner *s, const char *text, size_t size);
+
+/**
+ * Finish the last number and return the array of the numbers.
+ * It belongs to the caller and should be freed with free(). If
+ * the scanner is out of memory, the result is NULL with 0 count.
+ */
+int *
+int_scanner_finish(struct int_scanner *s, size_t *count);
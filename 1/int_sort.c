@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "libcoro.h"
+#include "int_sort.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define INT_SORT_X86 1
+#endif
+
+enum {
+	/** Runs of that size are sorted by insertion before merging. */
+	INT_SORT_RUN_SIZE = 32,
+	/** Numbers processed between the yield checks. */
+	INT_SORT_CHUNK = 4096,
+	/**
+	 * From this size the radix sort is faster than the merge
+	 * sort. Its passes do not depend on the size, so for small
+	 * arrays they are too expensive.
+	 */
+	INT_SORT_RADIX_MIN = 256,
+	INT_SORT_RADIX_BITS = 8,
+	INT_SORT_RADIX_BUCKETS = 1 << INT_SORT_RADIX_BITS,
+	INT_SORT_RADIX_PASSES = 32 / INT_SORT_RADIX_BITS,
+	/** Numbers in a vector register. */
+	INT_SORT_VEC = 8,
+	/** Block sorted by the network - a vector per column. */
+	INT_SORT_VEC_BLOCK = INT_SORT_VEC * INT_SORT_VEC,
+};
+
+const char *int_sort_algo_strs[] = {
+	"auto", "merge", "radix", "bitonic",
+};
+
+int
+int_sort_algo_by_name(const char *name)
+{
+	for (int i = 0; i < int_sort_algo_MAX; ++i) {
+		if (strcmp(int_sort_algo_strs[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static bool
+int_sort_has_avx2(void)
+{
+#if INT_SORT_X86
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+/**
+ * The bitonic hybrid is the fastest at any size, when there is
+ * AVX2. The radix sort is close to it on arrays fitting into the
+ * cache, but is slowed down by the cache and TLB misses of its
+ * scatters on the bigger ones.
+ */
+enum int_sort_algo
+int_sort_algo_choose(size_t size)
+{
+	if (size <= INT_SORT_RUN_SIZE)
+		return INT_SORT_MERGE;
+	if (int_sort_has_avx2())
+		return INT_SORT_BITONIC;
+	if (size >= INT_SORT_RADIX_MIN)
+		return INT_SORT_RADIX;
+	return INT_SORT_MERGE;
+}
+
+static void
+int_sort_insertion(int *arr, size_t size)
+{
+	for (size_t i = 1; i < size; ++i) {
+		int value = arr[i];
+		size_t j = i;
+		for (; j > 0 && arr[j - 1] > value; --j)
+			arr[j] = arr[j - 1];
+		arr[j] = value;
+	}
+}
+
+/**
+ * Merge sorted src[l, m) and src[m, r) into dst[l, r), yielding
+ * after each chunk. The step has no branches depending on the
+ * data, random input would mispredict them half of the time.
+ */
+static void
+int_sort_merge_runs(int *dst, const int *src, size_t l, size_t m, size_t r)
+{
+	size_t i = l, j = m, k = l;
+	while (i < m && j < r) {
+		size_t end = k + INT_SORT_CHUNK;
+		for (; k < end && i < m && j < r; ++k) {
+			int x = src[i], y = src[j];
+			bool is_left = x <= y;
+			dst[k] = is_left ? x : y;
+			i += is_left;
+			j += ! is_left;
+		}
+		coro_yield_if_expired();
+	}
+	memcpy(dst + k, src + i, (m - i) * sizeof(*dst));
+	k += m - i;
+	memcpy(dst + k, src + j, (r - j) * sizeof(*dst));
+}
+
+typedef void (*int_sort_merge_f)(int *dst, const int *src, size_t l,
+				 size_t m, size_t r);
+
+/**
+ * Merge the sorted runs of @a width pass by pass, from the array
+ * into the scratch buffer and back.
+ */
+static void
+int_sort_merge_passes(int *arr, int *scratch, size_t size, size_t width,
+		      int_sort_merge_f merge)
+{
+	int *src = arr;
+	int *dst = scratch;
+	for (; width < size; width *= 2) {
+		for (size_t l = 0; l < size; l += 2 * width) {
+			size_t m = size - l < width ? size : l + width;
+			size_t r = size - l < 2 * width ? size : l + 2 * width;
+			merge(dst, src, l, m, r);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	/* After an odd number of passes the result is in scratch. */
+	if (src != arr)
+		memcpy(arr, src, size * sizeof(*arr));
+}
+
+static void
+int_sort_merge(int *arr, int *scratch, size_t size)
+{
+	for (size_t l = 0; l < size; l += INT_SORT_RUN_SIZE) {
+		size_t n = size - l;
+		int_sort_insertion(arr + l, n < INT_SORT_RUN_SIZE ? n :
+					    INT_SORT_RUN_SIZE);
+		coro_yield_if_expired();
+	}
+	int_sort_merge_passes(arr, scratch, size, INT_SORT_RUN_SIZE,
+			      int_sort_merge_runs);
+}
+
+/**
+ * LSD radix sort. The sign bit is flipped in the keys, so the
+ * negative numbers go first. All the histograms are counted in
+ * one pass, and the passes where all the numbers have the same
+ * digit are skipped.
+ */
+static void
+int_sort_radix(int *arr, int *scratch, size_t size)
+{
+	size_t (*counts)[INT_SORT_RADIX_BUCKETS] =
+		calloc(INT_SORT_RADIX_PASSES, sizeof(*counts));
+	/* The merge sort needs nothing but the scratch. */
+	if (counts == NULL) {
+		int_sort_merge(arr, scratch, size);
+		return;
+	}
+	for (size_t i = 0; i < size; ++i) {
+		uint32_t key = (uint32_t)arr[i] ^ 0x80000000u;
+		for (int p = 0; p < INT_SORT_RADIX_PASSES; ++p)
+			++counts[p][(key >> (p * INT_SORT_RADIX_BITS)) & 0xff];
+		if (i % INT_SORT_CHUNK == 0)
+			coro_yield_if_expired();
+	}
+	int *src = arr;
+	int *dst = scratch;
+	for (int p = 0; p < INT_SORT_RADIX_PASSES; ++p) {
+		int shift = p * INT_SORT_RADIX_BITS;
+		uint32_t first = ((uint32_t)src[0] ^ 0x80000000u) >> shift;
+		if (counts[p][first & 0xff] == size)
+			continue;
+		size_t offsets[INT_SORT_RADIX_BUCKETS];
+		size_t sum = 0;
+		for (int b = 0; b < INT_SORT_RADIX_BUCKETS; ++b) {
+			offsets[b] = sum;
+			sum += counts[p][b];
+		}
+		for (size_t i = 0; i < size; ++i) {
+			uint32_t key = (uint32_t)src[i] ^ 0x80000000u;
+			dst[offsets[(key >> shift) & 0xff]++] = src[i];
+			if (i % INT_SORT_CHUNK == 0)
+				coro_yield_if_expired();
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != arr)
+		memcpy(arr, src, size * sizeof(*arr));
+	free(counts);
+}
+
+#if INT_SORT_X86
+
+#define INT_SORT_AVX2 __attribute__((target("avx2")))
+
+/** Compare-exchange of two vectors lane by lane. */
+static inline INT_SORT_AVX2 void
+int_sort_vec_cmpxchg(__m256i *a, __m256i *b)
+{
+	__m256i min = _mm256_min_epi32(*a, *b);
+	*b = _mm256_max_epi32(*a, *b);
+	*a = min;
+}
+
+/**
+ * Sort a bitonic sequence in one register - compare-exchange the
+ * lanes at the distance 4, then 2, then 1.
+ */
+static inline INT_SORT_AVX2 __m256i
+int_sort_vec_bitonic_clean(__m256i v)
+{
+	__m256i p = _mm256_permute2x128_si256(v, v, 1);
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, p),
+			       _mm256_max_epi32(v, p), 0xF0);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, p),
+			       _mm256_max_epi32(v, p), 0xCC);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm256_blend_epi32(_mm256_min_epi32(v, p),
+				  _mm256_max_epi32(v, p), 0xAA);
+}
+
+/**
+ * Merge two sorted vectors. @a a gets the 8 least numbers, @a b
+ * the 8 greatest, both sorted.
+ */
+static inline INT_SORT_AVX2 void
+int_sort_vec_merge(__m256i *a, __m256i *b)
+{
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i r = _mm256_permutevar8x32_epi32(*b, reverse);
+	__m256i lo = _mm256_min_epi32(*a, r);
+	__m256i hi = _mm256_max_epi32(*a, r);
+	*a = int_sort_vec_bitonic_clean(lo);
+	*b = int_sort_vec_bitonic_clean(hi);
+}
+
+/**
+ * Sort 64 numbers into 8 sorted runs of 8. The columns are sorted
+ * by the optimal 19 comparator network for 8 inputs, then the
+ * 8x8 matrix is transposed.
+ */
+static INT_SORT_AVX2 void
+int_sort_vec_block(int *arr)
+{
+	__m256i r[INT_SORT_VEC];
+	for (int i = 0; i < INT_SORT_VEC; ++i)
+		r[i] = _mm256_loadu_si256((const __m256i *)(arr + i * 8));
+	static const int network[][2] = {
+		{0, 2}, {1, 3}, {4, 6}, {5, 7},
+		{0, 4}, {1, 5}, {2, 6}, {3, 7},
+		{0, 1}, {2, 3}, {4, 5}, {6, 7},
+		{2, 4}, {3, 5},
+		{1, 4}, {3, 6},
+		{1, 2}, {3, 4}, {5, 6},
+	};
+	for (size_t i = 0; i < sizeof(network) / sizeof(network[0]); ++i)
+		int_sort_vec_cmpxchg(&r[network[i][0]], &r[network[i][1]]);
+	__m256i t[INT_SORT_VEC], u[INT_SORT_VEC];
+	for (int i = 0; i < INT_SORT_VEC; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < INT_SORT_VEC; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; ++i) {
+		r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+	for (int i = 0; i < INT_SORT_VEC; ++i)
+		_mm256_storeu_si256((__m256i *)(arr + i * 8), r[i]);
+}
+
+/**
+ * Merge runs by 8 numbers at once. The least 8 of the two vectors
+ * are stored, and the vector with the greater ones is merged with
+ * the next 8 numbers of the run, which has the lesser head. Runs,
+ * which are not made of whole vectors, are merged as scalars.
+ */
+static INT_SORT_AVX2 void
+int_sort_vec_merge_runs(int *dst, const int *src, size_t l, size_t m,
+			size_t r)
+{
+	if ((m - l) % INT_SORT_VEC != 0 || (r - m) % INT_SORT_VEC != 0 ||
+	    m == r) {
+		int_sort_merge_runs(dst, src, l, m, r);
+		return;
+	}
+	const int *a = src + l, *a_end = src + m;
+	const int *b = src + m, *b_end = src + r;
+	int *out = dst + l;
+	__m256i lo = _mm256_loadu_si256((const __m256i *)a);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)b);
+	a += INT_SORT_VEC;
+	b += INT_SORT_VEC;
+	for (size_t n = 1;; ++n) {
+		int_sort_vec_merge(&lo, &hi);
+		_mm256_storeu_si256((__m256i *)out, lo);
+		out += INT_SORT_VEC;
+		if (a < a_end && (b == b_end || *a <= *b)) {
+			lo = _mm256_loadu_si256((const __m256i *)a);
+			a += INT_SORT_VEC;
+		} else if (b < b_end) {
+			lo = _mm256_loadu_si256((const __m256i *)b);
+			b += INT_SORT_VEC;
+		} else {
+			break;
+		}
+		if (n % (INT_SORT_CHUNK / INT_SORT_VEC) == 0)
+			coro_yield_if_expired();
+	}
+	_mm256_storeu_si256((__m256i *)out, hi);
+}
+
+static INT_SORT_AVX2 void
+int_sort_bitonic(int *arr, int *scratch, size_t size)
+{
+	size_t l = 0;
+	for (; l + INT_SORT_VEC_BLOCK <= size; l += INT_SORT_VEC_BLOCK) {
+		int_sort_vec_block(arr + l);
+		if (l % INT_SORT_CHUNK == 0)
+			coro_yield_if_expired();
+	}
+	for (; l < size; l += INT_SORT_VEC) {
+		size_t n = size - l;
+		int_sort_insertion(arr + l, n < INT_SORT_VEC ? n :
+					    INT_SORT_VEC);
+	}
+	int_sort_merge_passes(arr, scratch, size, INT_SORT_VEC,
+			      int_sort_vec_merge_runs);
+}
+
+#endif /* INT_SORT_X86 */
+
+int
+int_sort(int *arr, size_t size, enum int_sort_algo algo)
+{
+	return int_sort_ex(arr, size, algo, NULL);
+}
+
+int
+int_sort_ex(int *arr, size_t size, enum int_sort_algo algo, int *scratch)
+{
+	if (algo == INT_SORT_AUTO)
+		algo = int_sort_algo_choose(size);
+	if (algo == INT_SORT_BITONIC && ! int_sort_has_avx2())
+		algo = INT_SORT_MERGE;
+	if (size <= INT_SORT_RUN_SIZE) {
+		int_sort_insertion(arr, size);
+		return 0;
+	}
+	int *buf = scratch;
+	if (buf == NULL) {
+		buf = malloc(size * sizeof(*buf));
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	switch (algo) {
+	case INT_SORT_RADIX:
+		int_sort_radix(arr, buf, size);
+		break;
+#if INT_SORT_X86
+	case INT_SORT_BITONIC:
+		int_sort_bitonic(arr, buf, size);
+		break;
+#endif
+	default:
+		int_sort_merge(arr, buf, size);
+		break;
+	}
+	if (buf != scratch)
+		free(buf);
+	return 0;
+}
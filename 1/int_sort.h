@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Sort engine for arrays of int. All the algorithms do bounded
+ * chunks of work between coro_yield_if_expired() calls, so a
+ * coroutine sorting a big array keeps to its time slice. Should
+ * be called after coro_sched_init().
+ */
+enum int_sort_algo {
+	/** Choose by the array size and the CPU. */
+	INT_SORT_AUTO,
+	/** Bottom-up merge sort over insertion sorted runs. */
+	INT_SORT_MERGE,
+	/** LSD radix sort, 4 passes by 8 bits. */
+	INT_SORT_RADIX,
+	/**
+	 * AVX2 sorting network for blocks of 64 numbers, then
+	 * merge sort with a vectorized bitonic merge. Falls back to
+	 * INT_SORT_MERGE without AVX2.
+	 */
+	INT_SORT_BITONIC,
+	int_sort_algo_MAX,
+};
+
+/** Names of the algorithms: "auto", "merge", ... */
+extern const char *int_sort_algo_strs[];
+
+/** Find the algorithm by name. -1, if it is unknown. */
+int
+int_sort_algo_by_name(const char *name);
+
+/** The algorithm INT_SORT_AUTO chooses for @a size numbers. */
+enum int_sort_algo
+int_sort_algo_choose(size_t size);
+
+/**
+ * Sort the array in place.
+ * @retval 0 Success.
+ * @retval -1 No memory for the scratch buffer, errno is set. The
+ *         array is not changed.
+ */
+int
+int_sort(int *arr, size_t size, enum int_sort_algo algo);
+
+/**
+ * Same as int_sort(), but with a scratch buffer of @a size
+ * numbers given by the caller. NULL means to allocate it. With
+ * the buffer given it can't fail.
+ */
+int
+int_sort_ex(int *arr, size_t size, enum int_sort_algo algo, int *scratch);
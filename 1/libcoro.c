@@ -1,76 +1,823 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "libcoro.h"
+#include "coro_stack.h"
+#include "coro_clock.h"
+#include "coro_timer.h"
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#elif defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#endif
+
+#if CORO_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+enum {
+	/**
+	 * How often coro_yield_if_expired() reads the clock when
+	 * there is no cheap hardware counter.
+	 */
+	CORO_QUANTUM_CHECK_PERIOD = 8,
+	/** Stack of the copier of the shared stacks. */
+	CORO_COPIER_STACK_SIZE = 64 * 1024,
+	/** Granularity of the saved copies of the shared stack. */
+	CORO_STACK_COPY_ALIGN = 256,
+};
+
+/*
+ * Context switch backend. By default a hand-written assembly
+ * switch is used on x86-64 and aarch64 - it saves only the
+ * callee-saved registers and does not enter the kernel neither on
+ * creation nor on a switch. Other platforms fall back to
+ * ucontext. The original sigaltstack + sigsetjmp implementation
+ * is kept to be able to compare them, and can be forced with
+ * -DLIBCORO_USE_SIGALTSTACK. -DLIBCORO_USE_UCONTEXT forces
+ * ucontext.
+ */
+#if defined(LIBCORO_USE_SIGALTSTACK)
+#define CORO_CTX_SIGALTSTACK 1
+#elif defined(LIBCORO_USE_UCONTEXT) || \
+	(! defined(__x86_64__) && ! defined(__aarch64__))
+#define CORO_CTX_UCONTEXT 1
+#include <ucontext.h>
+#else
+#define CORO_CTX_ASM 1
+#endif
+
+struct coro;
+
+#if CORO_CTX_ASM
+
+/** Saved context is just a stack pointer, the rest is on it. */
+struct coro_ctx {
+	void *sp;
+};
+
+/**
+ * Save callee-saved registers of the current context on its
+ * stack, store the stack pointer into @a from_sp and restore the
+ * context saved at @a to_sp.
+ */
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
+/**
+ * First function executed on a new stack. It takes the entry
+ * point and its argument from callee-saved registers, prepared by
+ * coro_ctx_init().
+ */
+void
+coro_ctx_start_asm(void);
+
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC(name) ".globl _" #name "\n_" #name ":\n"
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC(name) ".globl " #name "\n.type " #name \
+	", %function\n" #name ":\n"
+#endif
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	CORO_ASM_FUNC(coro_ctx_switch_asm)
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	CORO_ASM_FUNC(coro_ctx_start_asm)
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+);
+
+/** Size of the frame, popped by the switch: 6 registers + FPU. */
+enum { CORO_CTX_FRAME = 8 * 8 };
+
+static void
+coro_ctx_init(struct coro_ctx *ctx, void *stack, size_t size,
+	      void (*entry)(struct coro *), struct coro *arg)
+{
+	/*
+	 * After 'ret' into coro_ctx_start_asm the stack pointer
+	 * should be 16 byte aligned, so 'call' makes it look
+	 * exactly like a normal function entry.
+	 */
+	uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - 16 - CORO_CTX_FRAME);
+	memset(sp, 0, CORO_CTX_FRAME);
+	/* Default MXCSR and x87 control word. */
+	((uint32_t *)sp)[0] = 0x1F80;
+	((uint32_t *)sp)[1] = 0x037F;
+	sp[3] = (uint64_t)(uintptr_t)arg;
+	sp[4] = (uint64_t)(uintptr_t)entry;
+	sp[7] = (uint64_t)(uintptr_t)coro_ctx_start_asm;
+	ctx->sp = sp;
+}
+
+#else /* __aarch64__ */
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	CORO_ASM_FUNC(coro_ctx_switch_asm)
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".p2align 4\n"
+	CORO_ASM_FUNC(coro_ctx_start_asm)
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+);
+
+/** Size of the frame, popped by the switch: x19-x30, d8-d15. */
+enum { CORO_CTX_FRAME = 20 * 8 };
+
+static void
+coro_ctx_init(struct coro_ctx *ctx, void *stack, size_t size,
+	      void (*entry)(struct coro *), struct coro *arg)
+{
+	uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - CORO_CTX_FRAME);
+	memset(sp, 0, CORO_CTX_FRAME);
+	sp[0] = (uint64_t)(uintptr_t)entry;
+	sp[1] = (uint64_t)(uintptr_t)arg;
+	/* x29 (frame pointer) is 0 to terminate backtraces. */
+	sp[11] = (uint64_t)(uintptr_t)coro_ctx_start_asm;
+	ctx->sp = sp;
+}
+
+#endif /* __aarch64__ */
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_switch_asm(&from->sp, to->sp);
+}
+
+#elif CORO_CTX_UCONTEXT
+
+struct coro_ctx {
+	ucontext_t uc;
+};
+
+/**
+ * makecontext() can portably pass only int arguments, so the
+ * pointers are split into halves.
+ */
+static void
+coro_ctx_start(unsigned entry_hi, unsigned entry_lo, unsigned arg_hi,
+	       unsigned arg_lo)
+{
+	void (*entry)(struct coro *) = (void (*)(struct coro *))(uintptr_t)
+		(((uint64_t)entry_hi << 32) | entry_lo);
+	entry((struct coro *)(uintptr_t)(((uint64_t)arg_hi << 32) | arg_lo));
+}
+
+static void
+coro_ctx_init(struct coro_ctx *ctx, void *stack, size_t size,
+	      void (*entry)(struct coro *), struct coro *arg)
+{
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = size;
+	ctx->uc.uc_link = NULL;
+	uint64_t e = (uint64_t)(uintptr_t)entry;
+	uint64_t a = (uint64_t)(uintptr_t)arg;
+	makecontext(&ctx->uc, (void (*)(void))coro_ctx_start, 4,
+		    (unsigned)(e >> 32), (unsigned)e, (unsigned)(a >> 32),
+		    (unsigned)a);
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
+}
+
+#else /* CORO_CTX_SIGALTSTACK */
+
+struct coro_ctx {
+	sigjmp_buf buf;
+};
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+#endif /* CORO_CTX_SIGALTSTACK */
+
+/** Where the coroutine is now from the scheduler's point of view. */
+enum coro_state {
+	/** In a ready queue, waiting for its turn. */
+	CORO_STATE_READY,
+	/** Working right now. */
+	CORO_STATE_RUNNING,
+	/**
+	 * Working right now, but already woken up. So its next
+	 * coro_wait() returns right away.
+	 */
+	CORO_STATE_WOKEN,
+	/** Suspended until somebody wakes it up. */
+	CORO_STATE_BLOCKED,
+	/** Finished, waiting to be returned by coro_sched_wait(). */
+	CORO_STATE_FINISHED,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
+	/** Stack, used by the coroutine. Unused if it is shared. */
+	struct coro_stack stack;
+	/** True, if the coroutine runs on the shared stack of its thread. */
+	bool is_stack_shared;
+	/**
+	 * Used part of the shared stack, saved while another
+	 * coroutine occupies it.
+	 */
+	char *stack_copy;
+	size_t stack_copy_size;
+	size_t stack_copy_capacity;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_ctx ctx;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * enum coro_state. Accessed atomically, because wakeups
+	 * can come from other threads.
+	 */
+	int state;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Time slice in clock ticks. 0 means no limit. */
+	uint64_t quantum;
+	/** When the current time slice has started, in ticks. */
+	uint64_t slice_start;
+	/** Total time spent running, in ticks. */
+	uint64_t work_time;
+	/** When the coroutine became ready to run, in ticks. */
+	uint64_t ready_start;
+	/** Total time spent in ready queues, in ticks. */
+	uint64_t ready_time;
+	/**
+	 * Number of coro_yield_if_expired() calls left before the
+	 * clock is checked again.
+	 */
+	int check_countdown;
+	/** Thread, which created the coroutine. */
+	struct coro_thread *owner;
+	/** Timer of coro_wait_deadline(). */
+	struct coro_timer timer;
+	/** Thread, in which wheel the timer was armed. */
+	struct coro_thread *timer_thread;
+	/** True, if the timer has expired before the wakeup. */
+	bool is_timer_fired;
+	/** True, if the coroutine is asked to stop. */
+	bool is_cancelled;
+	/** Group of the coroutine, NULL if none. */
+	struct coro_group *group;
+	/** Links in the list of the running group members. */
+	struct coro *group_next, *group_prev;
+	/**
+	 * Values of the coroutine-local storage keys. Allocated
+	 * when the first one is set.
+	 */
+	void **locals;
+	/** Links in a ready or finished queue. */
 	struct coro *next, *prev;
 };
 
+/** Intrusive FIFO of coroutines. */
+struct coro_queue {
+	struct coro *first, *last;
+	int size;
+};
+
+/** Ready queue of one thread. Others can steal from it. */
+struct coro_runq {
+	struct coro_spinlock lock;
+	struct coro_queue queue;
+};
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * What to do with the coroutine, which has just switched out. It
+ * is done by the next coroutine right after the switch, when the
+ * old context is saved completely. Otherwise another thread could
+ * pick the old coroutine up and resume it from a stale context.
  */
-static struct coro coro_sched;
+enum coro_after {
+	CORO_AFTER_NONE,
+	/** Put into the ready queue. */
+	CORO_AFTER_READY,
+	/** Mark as blocked, if it was not woken up meanwhile. */
+	CORO_AFTER_BLOCK,
+	/** Put into the finished queue. */
+	CORO_AFTER_FINISH,
+};
+
+/** Scheduler state of one thread. */
+struct coro_thread {
+	/**
+	 * Scheduler is a main coroutine - it catches and returns
+	 * dead ones to a user. In worker threads it is the loop
+	 * looking for coroutines to run.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this_ptr;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_sched_waiting;
+	/**
+	 * Where to switch when nothing is ready. The scheduler in
+	 * worker threads, NULL in others.
+	 */
+	struct coro *idle;
+	/** Coroutines able to run, in the order of their turn. */
+	struct coro_runq *runq;
+	/** Ready queue of a non-worker thread. */
+	struct coro_runq own_runq;
+	/** Finished coroutines, not yet returned to the user. */
+	struct coro_queue finished;
+	/** Worker index. -1, if it is not a worker thread. */
+	int worker_id;
+	/** Coroutine, switched out last time, and what to do with it. */
+	struct coro *after_coro;
+	enum coro_after after;
+	/** Lock to release after the switch. */
+	struct coro_spinlock *after_unlock;
+	/**
+	 * Coroutines woken up by threads without a scheduler, for
+	 * example on I/O completion. The ready queue is not locked
+	 * without workers, so they are moved there by this thread.
+	 */
+	struct coro_queue remote;
+	/** Protects the remote queue. */
+	pthread_mutex_t remote_lock;
+	/**
+	 * Number of the coroutines of this thread, suspended in
+	 * coro_wait(). While there are some, the scheduler can wait
+	 * for a remote wakeup.
+	 */
+	int blocked_count;
+	/** The scheduler waits on it, when all are blocked. */
+	pthread_cond_t remote_cond;
+	/**
+	 * Stack of the coroutines with stack_shared attribute.
+	 * Created with the first of them.
+	 */
+	struct coro_stack shared_stack;
+	/** Coroutine, whose frames are on the shared stack now. */
+	struct coro *shared_occupant;
+	/**
+	 * Context, which swaps the frames on the shared stack. It
+	 * has an own small stack, because the copy can't be done
+	 * while running on the shared one.
+	 */
+	struct coro_ctx copier_ctx;
+	struct coro_stack copier_stack;
+	/** Coroutine to switch to after the copy. */
+	struct coro *copier_to;
+	/** Timers of the coroutines, suspended by this thread. */
+	struct coro_timer_wheel timers;
+	/**
+	 * Protects the timers, when there are workers. Then a
+	 * coroutine can disarm its timer from another thread.
+	 */
+	struct coro_spinlock timers_lock;
+	/**
+	 * Clock ticks, when the timers should be checked next.
+	 * UINT64_MAX, if there are none. It is read on each yield,
+	 * so the timers cost nothing, while they are not used.
+	 */
+	uint64_t timers_check;
+};
+
+/** A thread, running coroutines in M:N mode. */
+struct coro_worker {
+	pthread_t thread;
+	int id;
+	struct coro_runq runq;
+};
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * State of M:N mode. Coroutines run on the worker threads, and
+ * the thread which started them only waits for finished ones.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static struct {
+	/** 0, if the mode is off. */
+	int worker_count;
+	struct coro_worker *workers;
+	/** Protects the members below and is used by the condvars. */
+	pthread_mutex_t lock;
+	/** Idle workers wait on it for new coroutines. */
+	pthread_cond_t work_cond;
+	/** coro_sched_wait() waits on it for finished coroutines. */
+	pthread_cond_t finish_cond;
+	struct coro_queue finished;
+	/** Coroutines not yet returned by coro_sched_wait(). */
+	int live_count;
+	/** Number of sleeping workers. */
+	int idle_count;
+	/** Where to put the next coroutine from a non-worker. */
+	int next_worker;
+	bool is_stopping;
+} coro_mt = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.finish_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Group of coroutines. Its members are deleted right when they
+ * finish, and the group only keeps their count and the first
+ * failure.
+ */
+struct coro_group {
+	struct coro_spinlock lock;
+	/** Members, which have not finished yet. */
+	struct coro *first;
+	/** Number of them. Read without the lock by the joiners. */
+	int live_count;
+	/** Status of the first failed member, 0 if none. */
+	int status;
+	/** True, if the new members should be cancelled right away. */
+	bool is_cancelled;
+	/** Coroutine, waiting in coro_group_join(), if any. */
+	struct coro *joiner;
+};
+
+static void
+coro_group_finish(struct coro *c);
+
+/** A coroutine-local storage key. */
+struct coro_key {
+	bool is_used;
+	void (*destructor)(void *);
+};
+
+/** Keys of the coroutine-local storage, and their lock. */
+static struct coro_key coro_keys[CORO_KEY_MAX];
+static struct coro_spinlock coro_keys_lock;
+
+/** Scheduler hooks. They are used only if they are on. */
+static struct coro_hooks coro_hooks;
+static bool coro_hooks_are_on = false;
+
+static __thread struct coro_thread coro_thread_local;
+#if CORO_CTX_SIGALTSTACK
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
  * sigaltstack etc.
  */
 static sigjmp_buf start_point;
+#endif
 
-/** Add a new coroutine to the beginning of the list. */
+/**
+ * Scheduler state of the current thread. A coroutine can continue
+ * on another thread after a switch, so it should be fetched again
+ * after each switch. The function is not inlined and not pure to
+ * prevent the compiler from reusing the address computed before
+ * the switch.
+ */
+static __attribute__((noinline)) struct coro_thread *
+coro_thread(void)
+{
+	struct coro_thread *t = &coro_thread_local;
+	__asm__ __volatile__("" : "+r"(t));
+	return t;
+}
+
+void
+coro_spinlock_create(struct coro_spinlock *l)
+{
+	l->is_locked = 0;
+}
+
+void
+coro_spinlock_lock(struct coro_spinlock *l)
+{
+	while (__atomic_exchange_n(&l->is_locked, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&l->is_locked, __ATOMIC_RELAXED))
+			sched_yield();
+	}
+}
+
+void
+coro_spinlock_unlock(struct coro_spinlock *l)
+{
+	__atomic_store_n(&l->is_locked, 0, __ATOMIC_RELEASE);
+}
+
+/** Add a coroutine to the end of the queue. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+	/* Read without the lock to check for emptiness. */
+	__atomic_store_n(&q->size, q->size + 1, __ATOMIC_RELAXED);
+}
+
+/** Remove a coroutine from any place in the queue. */
+static inline void
+coro_queue_remove(struct coro_queue *q, struct coro *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		q->first = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		q->last = c->prev;
+	c->next = c->prev = NULL;
+	__atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+}
+
+/** Remove and return the first coroutine. NULL, if empty. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_remove(q, c);
+	return c;
+}
+
+/** Ready queues are locked only when there are worker threads. */
+static inline void
+coro_runq_lock(struct coro_runq *q)
+{
+	if (coro_mt.worker_count > 0)
+		coro_spinlock_lock(&q->lock);
+}
+
+static inline void
+coro_runq_unlock(struct coro_runq *q)
+{
+	if (coro_mt.worker_count > 0)
+		coro_spinlock_unlock(&q->lock);
+}
+
+static inline int
+coro_runq_size(struct coro_runq *q)
+{
+	return __atomic_load_n(&q->queue.size, __ATOMIC_RELAXED);
+}
+
+static inline struct coro *
+coro_runq_pop(struct coro_runq *q)
+{
+	if (coro_runq_size(q) == 0)
+		return NULL;
+	coro_runq_lock(q);
+	struct coro *c = coro_queue_pop(&q->queue);
+	coro_runq_unlock(q);
+	return c;
+}
+
+/** Wake up a sleeping worker, if any, to pick up new work. */
 static void
-coro_list_add(struct coro *c)
+coro_mt_notify(void)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	/*
+	 * Pairs with the increment of idle_count in the worker,
+	 * so either the worker sees the new coroutine, or it is
+	 * seen here as idle.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_mt.idle_count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&coro_mt.lock);
+	pthread_cond_signal(&coro_mt.work_cond);
+	pthread_mutex_unlock(&coro_mt.lock);
 }
 
-/** Remove a coroutine from the list. */
+/**
+ * Put a coroutine, which became ready, into a ready queue. The
+ * thread's own queue, if it runs coroutines. Otherwise the
+ * workers get them in turns. A thread without a scheduler hands
+ * it over to the owner thread.
+ */
 static void
-coro_list_delete(struct coro *c)
+coro_make_ready(struct coro_thread *t, struct coro *c)
+{
+	struct coro_runq *q = t->runq;
+	c->ready_start = coro_clock_ticks();
+	if (q == NULL && coro_mt.worker_count == 0) {
+		struct coro_thread *owner = c->owner;
+		__atomic_store_n(&c->state, CORO_STATE_READY,
+				 __ATOMIC_RELAXED);
+		pthread_mutex_lock(&owner->remote_lock);
+		coro_queue_push(&owner->remote, c);
+		pthread_cond_signal(&owner->remote_cond);
+		pthread_mutex_unlock(&owner->remote_lock);
+		return;
+	}
+	if (coro_mt.worker_count > 0 && (q == NULL || t->worker_id < 0)) {
+		int i = __atomic_fetch_add(&coro_mt.next_worker, 1,
+					   __ATOMIC_RELAXED);
+		q = &coro_mt.workers[i % coro_mt.worker_count].runq;
+	}
+	__atomic_store_n(&c->state, CORO_STATE_READY, __ATOMIC_RELAXED);
+	coro_runq_lock(q);
+	coro_queue_push(&q->queue, c);
+	coro_runq_unlock(q);
+	if (coro_mt.worker_count > 0)
+		coro_mt_notify();
+}
+
+long long
+coro_now_nsec(void)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void
+coro_timers_lock(struct coro_thread *t)
+{
+	if (coro_mt.worker_count > 0)
+		coro_spinlock_lock(&t->timers_lock);
+}
+
+static inline void
+coro_timers_unlock(struct coro_thread *t)
+{
+	if (coro_mt.worker_count > 0)
+		coro_spinlock_unlock(&t->timers_lock);
+}
+
+/**
+ * When the thread should process the timers next, in nanoseconds.
+ * -1, if there are no timers. Should be called under the lock.
+ */
+static long long
+coro_timers_next_nsec(struct coro_thread *t)
+{
+	uint64_t next = coro_timer_wheel_next(&t->timers);
+	if (next == UINT64_MAX)
+		return -1;
+	return (long long)(next << CORO_TIMER_TICK_SHIFT);
+}
+
+/** Recalculate when to check the timers. Called under the lock. */
+static void
+coro_timers_update_check(struct coro_thread *t, long long now)
+{
+	long long next = coro_timers_next_nsec(t);
+	uint64_t check = UINT64_MAX;
+	if (next >= 0) {
+		check = coro_clock_ticks();
+		if (next > now)
+			check += coro_clock_nsec_to_ticks(next - now);
+	}
+	__atomic_store_n(&t->timers_check, check, __ATOMIC_RELAXED);
+}
+
+static void
+coro_timer_fire(struct coro_timer *timer, void *arg)
+{
+	(void)arg;
+	struct coro *c = (struct coro *)
+		((char *)timer - offsetof(struct coro, timer));
+	c->is_timer_fired = true;
+	coro_wakeup(c);
+}
+
+/** Wake up the coroutines, whose timers have expired. */
+static void
+coro_timers_run(struct coro_thread *t)
+{
+	long long now = coro_now_nsec();
+	coro_timers_lock(t);
+	coro_timer_wheel_advance(&t->timers, coro_timer_tick(now),
+				 coro_timer_fire, NULL);
+	coro_timers_update_check(t, now);
+	coro_timers_unlock(t);
+}
+
+/** Run the timers, if any of them could have expired. */
+static inline void
+coro_timers_check(struct coro_thread *t)
+{
+	uint64_t check = __atomic_load_n(&t->timers_check, __ATOMIC_RELAXED);
+	if (check != UINT64_MAX && coro_clock_ticks() >= check)
+		coro_timers_run(t);
+}
+
+/**
+ * Wait on the condition variable until the thread's next timer,
+ * if there is any. Return true, if the timers should be run.
+ */
+static bool
+coro_timers_cond_wait(struct coro_thread *t, pthread_cond_t *cond,
+		      pthread_mutex_t *mutex)
+{
+	coro_timers_lock(t);
+	long long next = coro_timers_next_nsec(t);
+	coro_timers_unlock(t);
+	if (next < 0) {
+		pthread_cond_wait(cond, mutex);
+		return false;
+	}
+	if (next <= coro_now_nsec())
+		return true;
+	struct timespec ts;
+	ts.tv_sec = next / 1000000000;
+	ts.tv_nsec = next % 1000000000;
+	return pthread_cond_timedwait(cond, mutex, &ts) == ETIMEDOUT;
+}
+
+/** Condition variables of the scheduler wait by the monotonic clock. */
+static void
+coro_cond_create_monotonic(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
 }
 
 int
@@ -91,65 +838,694 @@ coro_is_finished(const struct coro *c)
 	return c->is_finished;
 }
 
+long long
+coro_stack_usage(const struct coro *c)
+{
+	return coro_stack_used(&c->stack);
+}
+
+bool
+coro_stack_is_shared(const struct coro *c)
+{
+	return c->is_stack_shared;
+}
+
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	if (c->is_stack_shared) {
+		/* It is deleted by its own thread, no workers. */
+		if (c->owner->shared_occupant == c)
+			c->owner->shared_occupant = NULL;
+		free(c->stack_copy);
+	} else {
+		coro_stack_destroy(&c->stack);
+	}
+	free(c->locals);
 	free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/**
+ * Account the work time of the coroutine going to sleep, and
+ * start a new time slice for the one being resumed. The one going
+ * to sleep is assumed ready, a blocked one gets a new ready start
+ * when it is woken up.
+ */
+static inline void
+coro_account_switch(struct coro *from, struct coro *to)
+{
+	uint64_t now = coro_clock_ticks();
+	from->work_time += now - from->slice_start;
+	from->ready_start = now;
+	to->ready_time += now - to->ready_start;
+	to->slice_start = now;
+	to->check_countdown = 0;
+}
+
+/**
+ * Finish the switch of the previous coroutine to this one - put
+ * it where it belongs.
+ */
+static void
+coro_after_switch(void)
+{
+	struct coro_thread *t = coro_thread();
+	if (__atomic_load_n(&coro_hooks_are_on, __ATOMIC_RELAXED) &&
+	    coro_hooks.switch_in != NULL && t->this_ptr != &t->sched)
+		coro_hooks.switch_in(t->this_ptr, coro_hooks.arg);
+	struct coro *c = t->after_coro;
+	enum coro_after after = t->after;
+	struct coro_spinlock *unlock = t->after_unlock;
+	t->after = CORO_AFTER_NONE;
+	t->after_unlock = NULL;
+	switch (after) {
+	case CORO_AFTER_NONE:
+		break;
+	case CORO_AFTER_READY:
+		__atomic_store_n(&c->state, CORO_STATE_READY,
+				 __ATOMIC_RELAXED);
+		coro_runq_lock(t->runq);
+		coro_queue_push(&t->runq->queue, c);
+		coro_runq_unlock(t->runq);
+		break;
+	case CORO_AFTER_BLOCK: {
+		__atomic_add_fetch(&c->owner->blocked_count, 1,
+				   __ATOMIC_RELAXED);
+		int state = CORO_STATE_RUNNING;
+		if (! __atomic_compare_exchange_n(&c->state, &state,
+						  CORO_STATE_BLOCKED, false,
+						  __ATOMIC_ACQ_REL,
+						  __ATOMIC_ACQUIRE)) {
+			/* Was woken up before it managed to block. */
+			__atomic_sub_fetch(&c->owner->blocked_count, 1,
+					   __ATOMIC_RELAXED);
+			coro_make_ready(t, c);
+		}
+		break;
+	}
+	case CORO_AFTER_FINISH:
+		if (c->group != NULL) {
+			coro_group_finish(c);
+			break;
+		}
+		if (coro_mt.worker_count == 0) {
+			coro_queue_push(&t->finished, c);
+			break;
+		}
+		pthread_mutex_lock(&coro_mt.lock);
+		coro_queue_push(&coro_mt.finished, c);
+		pthread_cond_signal(&coro_mt.finish_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+		break;
+	}
+	if (unlock != NULL)
+		coro_spinlock_unlock(unlock);
+}
+
+/**
+ * Switch the current coroutine to an arbitrary one. @a after
+ * tells what to do with the current one once it is switched out,
+ * and @a unlock is released after that.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_switch(struct coro_thread *t, struct coro *to, enum coro_after after,
+	    struct coro_spinlock *unlock)
 {
-	struct coro *from = coro_this_ptr;
+	struct coro *from = t->this_ptr;
+	if (__atomic_load_n(&coro_hooks_are_on, __ATOMIC_RELAXED) &&
+	    coro_hooks.switch_out != NULL && after != CORO_AFTER_FINISH &&
+	    from != &t->sched)
+		coro_hooks.switch_out(from, coro_hooks.arg);
 	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	coro_account_switch(from, to);
+	t->after_coro = from;
+	t->after = after;
+	t->after_unlock = unlock;
+	__atomic_store_n(&to->state, CORO_STATE_RUNNING, __ATOMIC_RELAXED);
+	t->this_ptr = to;
+#if CORO_CTX_ASM
+	/* Its frames are not on the shared stack - bring them in. */
+	if (to->is_stack_shared && t->shared_occupant != to) {
+		t->copier_to = to;
+		coro_ctx_switch(&from->ctx, &t->copier_ctx);
+	} else
+#endif
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	coro_after_switch();
 }
 
 void
 coro_yield(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
+	struct coro_thread *t = coro_thread();
+	coro_timers_check(t);
+	struct coro *to = coro_runq_pop(t->runq);
+	/* Nobody else can run - continue. */
 	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+		return;
+	coro_switch(t, to, CORO_AFTER_READY, NULL);
+}
+
+bool
+coro_yield_if_expired(void)
+{
+	struct coro_thread *t = coro_thread();
+	struct coro *c = t->this_ptr;
+	if (c->quantum == 0 || --c->check_countdown > 0)
+		return false;
+	/*
+	 * Without a hardware counter the clock is a vDSO call, so
+	 * it is read only once in several calls.
+	 */
+	c->check_countdown = coro_clock_is_counter ? 1 :
+			     CORO_QUANTUM_CHECK_PERIOD;
+	uint64_t now = coro_clock_ticks();
+	if (now - c->slice_start < c->quantum)
+		return false;
+	coro_timers_check(t);
+	if (coro_runq_size(t->runq) == 0) {
+		/* Nobody to yield to - just start a new slice. */
+		c->work_time += now - c->slice_start;
+		c->slice_start = now;
+		return false;
+	}
+	coro_yield();
+	return true;
+}
+
+void
+coro_set_quantum(struct coro *c, long long nsec)
+{
+	c->quantum = nsec > 0 ? coro_clock_nsec_to_ticks(nsec) : 0;
+	if (nsec > 0 && c->quantum == 0)
+		c->quantum = 1;
+}
+
+long long
+coro_work_time(const struct coro *c)
+{
+	uint64_t ticks = c->work_time;
+	if (c == coro_thread()->this_ptr)
+		ticks += coro_clock_ticks() - c->slice_start;
+	return coro_clock_ticks_to_nsec(ticks);
+}
+
+long long
+coro_ready_time(const struct coro *c)
+{
+	return coro_clock_ticks_to_nsec(c->ready_time);
+}
+
+void
+coro_wait_unlock(struct coro_spinlock *l)
+{
+	struct coro_thread *t = coro_thread();
+	coro_timers_check(t);
+	struct coro *to = coro_runq_pop(t->runq);
+	if (to == NULL)
+		to = t->idle;
+	if (to == NULL) {
+		printf("Critical error - all coroutines are blocked!\n");
+		exit(-1);
+	}
+	coro_switch(t, to, CORO_AFTER_BLOCK, l);
+}
+
+void
+coro_wait(void)
+{
+	coro_wait_unlock(NULL);
+}
+
+bool
+coro_wait_unlock_deadline(struct coro_spinlock *l, long long deadline)
+{
+	struct coro_thread *t = coro_thread();
+	struct coro *c = t->this_ptr;
+	long long now = coro_now_nsec();
+	if (deadline <= now) {
+		if (l != NULL)
+			coro_spinlock_unlock(l);
+		return false;
+	}
+	c->is_timer_fired = false;
+	c->timer_thread = t;
+	coro_timers_lock(t);
+	/* Rounded up, so it never fires before the deadline. */
+	coro_timer_add(&t->timers, &c->timer,
+		       coro_timer_tick(deadline + CORO_TIMER_TICK_NSEC - 1));
+	coro_timers_update_check(t, now);
+	coro_timers_unlock(t);
+	coro_wait_unlock(l);
+	/*
+	 * Can continue on another thread. The timer is disarmed
+	 * under the lock, so a firing one is done with the
+	 * coroutine after that.
+	 */
+	t = c->timer_thread;
+	coro_timers_lock(t);
+	coro_timer_remove(&t->timers, &c->timer);
+	bool is_fired = c->is_timer_fired;
+	coro_timers_unlock(t);
+	return ! is_fired;
+}
+
+bool
+coro_wait_deadline(long long deadline)
+{
+	return coro_wait_unlock_deadline(NULL, deadline);
+}
+
+void
+coro_sleep(long long nsec)
+{
+	long long deadline = coro_now_nsec() + nsec;
+	if (! coro_is_inside()) {
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		return;
+	}
+	/* A wakeup not by the timer is spurious here. */
+	while (coro_wait_deadline(deadline) && ! coro_is_cancelled())
+		;
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	int state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	while (true) {
+		if (state == CORO_STATE_BLOCKED) {
+			if (! __atomic_compare_exchange_n(&c->state, &state,
+					CORO_STATE_READY, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				continue;
+			/*
+			 * Queued before it stops being counted as
+			 * blocked, so the scheduler does not see
+			 * neither blocked nor queued coroutines and
+			 * does not decide that all have finished.
+			 */
+			coro_make_ready(coro_thread(), c);
+			__atomic_sub_fetch(&c->owner->blocked_count, 1,
+					   __ATOMIC_RELEASE);
+			return;
+		}
+		/*
+		 * Still running, maybe on the way to block. Leave a
+		 * mark so it does not block.
+		 */
+		if (state == CORO_STATE_RUNNING) {
+			if (! __atomic_compare_exchange_n(&c->state, &state,
+					CORO_STATE_WOKEN, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				continue;
+		}
+		return;
+	}
+}
+
+/** Init the scheduler state of the current thread. */
+static void
+coro_thread_create(struct coro_thread *t, struct coro_runq *runq,
+		   int worker_id)
+{
+	memset(t, 0, sizeof(*t));
+	t->sched.state = CORO_STATE_RUNNING;
+	t->sched.slice_start = coro_clock_ticks();
+	t->sched.ready_start = t->sched.slice_start;
+	t->this_ptr = &t->sched;
+	t->worker_id = worker_id;
+	t->idle = worker_id >= 0 ? &t->sched : NULL;
+	t->runq = runq != NULL ? runq : &t->own_runq;
+	pthread_mutex_init(&t->remote_lock, NULL);
+	coro_cond_create_monotonic(&t->remote_cond);
+	coro_spinlock_create(&t->timers_lock);
+	coro_timer_wheel_create(&t->timers, coro_timer_tick(coro_now_nsec()));
+	t->timers_check = UINT64_MAX;
 }
 
 void
 coro_sched_init(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	coro_clock_init();
+	coro_thread_create(coro_thread(), NULL, -1);
 }
 
-struct coro *
-coro_sched_wait(void)
+/** Take a coroutine from the ready queue of another worker. */
+static struct coro *
+coro_worker_steal(struct coro_worker *w)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	for (int i = 1; i < coro_mt.worker_count; ++i) {
+		struct coro_worker *victim =
+			&coro_mt.workers[(w->id + i) % coro_mt.worker_count];
+		struct coro *c = coro_runq_pop(&victim->runq);
+		if (c != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+static bool
+coro_mt_has_work(void)
+{
+	for (int i = 0; i < coro_mt.worker_count; ++i) {
+		if (coro_runq_size(&coro_mt.workers[i].runq) > 0)
+			return true;
+	}
+	return false;
+}
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_thread_create(coro_thread(), &w->runq, w->id);
+	while (true) {
+		struct coro_thread *t = coro_thread();
+		coro_timers_check(t);
+		struct coro *to = coro_runq_pop(&w->runq);
+		if (to == NULL)
+			to = coro_worker_steal(w);
+		if (to != NULL) {
+			coro_switch(t, to, CORO_AFTER_NONE, NULL);
+			continue;
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		/* Sleep until new work or the next own timer. */
+		bool is_timeout = false;
+		pthread_mutex_lock(&coro_mt.lock);
+		__atomic_add_fetch(&coro_mt.idle_count, 1, __ATOMIC_SEQ_CST);
+		while (! coro_mt.is_stopping && ! coro_mt_has_work() &&
+		       ! is_timeout) {
+			is_timeout = coro_timers_cond_wait(t,
+				&coro_mt.work_cond, &coro_mt.lock);
+		}
+		__atomic_sub_fetch(&coro_mt.idle_count, 1, __ATOMIC_SEQ_CST);
+		bool is_stopping = coro_mt.is_stopping;
+		pthread_mutex_unlock(&coro_mt.lock);
+		if (is_stopping)
+			break;
+		if (is_timeout)
+			coro_timers_run(t);
 	}
+	coro_stack_cache_flush();
 	return NULL;
 }
 
+int
+coro_sched_start_workers(int count)
+{
+	if (count <= 0 || coro_mt.worker_count > 0)
+		return -1;
+#if CORO_CTX_SIGALTSTACK
+	/* The bootstrap via a signal handler is process-wide. */
+	return -1;
+#endif
+	struct coro_thread *t = coro_thread();
+	if (coro_runq_size(t->runq) != 0 || t->finished.size != 0)
+		return -1;
+	coro_mt.workers = calloc(count, sizeof(coro_mt.workers[0]));
+	if (coro_mt.workers == NULL)
+		return -1;
+	/* Idle workers wait for their timers by the monotonic clock. */
+	pthread_cond_destroy(&coro_mt.work_cond);
+	coro_cond_create_monotonic(&coro_mt.work_cond);
+	coro_mt.is_stopping = false;
+	coro_mt.live_count = 0;
+	coro_mt.next_worker = 0;
+	for (int i = 0; i < count; ++i)
+		coro_mt.workers[i].id = i;
+	/* Queues should become locked before any worker starts. */
+	coro_mt.worker_count = count;
+	for (int i = 0; i < count; ++i) {
+		if (pthread_create(&coro_mt.workers[i].thread, NULL,
+				   coro_worker_f, &coro_mt.workers[i]) != 0)
+			handle_error();
+	}
+	return 0;
+}
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_mt.worker_count > 0) {
+		pthread_mutex_lock(&coro_mt.lock);
+		coro_mt.is_stopping = true;
+		pthread_cond_broadcast(&coro_mt.work_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+		for (int i = 0; i < coro_mt.worker_count; ++i)
+			pthread_join(coro_mt.workers[i].thread, NULL);
+		free(coro_mt.workers);
+		coro_mt.workers = NULL;
+		coro_mt.worker_count = 0;
+	}
+	struct coro_thread *t = coro_thread();
+	free(t->sched.locals);
+	t->sched.locals = NULL;
+	if (t->shared_stack.base != NULL) {
+		coro_stack_destroy(&t->shared_stack);
+		coro_stack_destroy(&t->copier_stack);
+		memset(&t->shared_stack, 0, sizeof(t->shared_stack));
+		t->shared_occupant = NULL;
+	}
+	coro_stack_cache_flush();
+}
+
+/** Move the coroutines, woken up by other threads, to the ready queue. */
+static void
+coro_sched_take_remote(struct coro_thread *t)
+{
+	struct coro *c;
+	while ((c = coro_queue_pop(&t->remote)) != NULL)
+		coro_queue_push(&t->runq->queue, c);
+}
+
+/**
+ * Sleep until another thread wakes up a coroutine, or a timer
+ * expires. Return false, if none is blocked, so nothing can come.
+ */
+static bool
+coro_sched_wait_remote(struct coro_thread *t)
+{
+	bool is_timeout = false;
+	pthread_mutex_lock(&t->remote_lock);
+	while (t->remote.size == 0 && ! is_timeout) {
+		if (__atomic_load_n(&t->blocked_count, __ATOMIC_ACQUIRE) == 0)
+			break;
+		is_timeout = coro_timers_cond_wait(t, &t->remote_cond,
+						   &t->remote_lock);
+	}
+	bool ok = t->remote.size > 0 || is_timeout;
+	coro_sched_take_remote(t);
+	pthread_mutex_unlock(&t->remote_lock);
+	if (is_timeout)
+		coro_timers_run(t);
+	return ok;
+}
+
+/** coro_sched_wait() in M:N mode - just wait for a finished one. */
+static struct coro *
+coro_sched_wait_mt(void)
+{
+	pthread_mutex_lock(&coro_mt.lock);
+	while (coro_mt.finished.size == 0 &&
+	       __atomic_load_n(&coro_mt.live_count, __ATOMIC_RELAXED) > 0)
+		pthread_cond_wait(&coro_mt.finish_cond, &coro_mt.lock);
+	struct coro *c = coro_queue_pop(&coro_mt.finished);
+	if (c != NULL)
+		__atomic_sub_fetch(&coro_mt.live_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&coro_mt.lock);
+	return c;
+}
+
+/**
+ * Run the coroutines until any of them finishes and return it,
+ * or, if @a g is not NULL, until the group has no members. NULL,
+ * if nothing can finish anymore, or the group is done.
+ */
+static struct coro *
+coro_sched_run(struct coro_group *g)
+{
+	struct coro_thread *t = coro_thread();
+	while (true) {
+		if (g != NULL) {
+			if (g->live_count == 0)
+				return NULL;
+		} else {
+			struct coro *c = coro_queue_pop(&t->finished);
+			if (c != NULL)
+				return c;
+		}
+		coro_timers_check(t);
+		if (__atomic_load_n(&t->remote.size, __ATOMIC_RELAXED) > 0) {
+			pthread_mutex_lock(&t->remote_lock);
+			coro_sched_take_remote(t);
+			pthread_mutex_unlock(&t->remote_lock);
+		}
+		struct coro *to = coro_runq_pop(t->runq);
+		if (to == NULL) {
+			/*
+			 * All the rest are blocked. Only another
+			 * thread can wake them up now.
+			 */
+			if (! coro_sched_wait_remote(t))
+				return NULL;
+			continue;
+		}
+		/*
+		 * The scheduler is in the ready queue too, so it
+		 * gets control back at least once per round.
+		 */
+		t->is_sched_waiting = true;
+		coro_switch(t, to, CORO_AFTER_READY, NULL);
+		t->is_sched_waiting = false;
+	}
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	if (coro_mt.worker_count > 0)
+		return coro_sched_wait_mt();
+	return coro_sched_run(NULL);
+}
+
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	return coro_thread()->this_ptr;
+}
+
+bool
+coro_is_inside(void)
+{
+	struct coro_thread *t = coro_thread();
+	return t->this_ptr != NULL && t->this_ptr != &t->sched;
+}
+
+int
+coro_key_create(int *key, void (*destructor)(void *))
+{
+	int rc = -1;
+	coro_spinlock_lock(&coro_keys_lock);
+	for (int i = 0; i < CORO_KEY_MAX; ++i) {
+		if (! coro_keys[i].is_used) {
+			coro_keys[i].is_used = true;
+			coro_keys[i].destructor = destructor;
+			*key = i;
+			rc = 0;
+			break;
+		}
+	}
+	coro_spinlock_unlock(&coro_keys_lock);
+	return rc;
+}
+
+void
+coro_key_delete(int key)
+{
+	coro_spinlock_lock(&coro_keys_lock);
+	coro_keys[key].is_used = false;
+	coro_keys[key].destructor = NULL;
+	coro_spinlock_unlock(&coro_keys_lock);
+}
+
+void *
+coro_local_get(int key)
+{
+	void **locals = coro_thread()->this_ptr->locals;
+	return locals != NULL ? locals[key] : NULL;
+}
+
+void
+coro_local_set(int key, void *value)
+{
+	struct coro *c = coro_thread()->this_ptr;
+	if (c->locals == NULL) {
+		if (value == NULL)
+			return;
+		c->locals = calloc(CORO_KEY_MAX, sizeof(c->locals[0]));
+		if (c->locals == NULL)
+			handle_error();
+	}
+	c->locals[key] = value;
+}
+
+/**
+ * Call the destructors of the local storage values. A value is
+ * reset before its destructor is called, so the destructor can
+ * set it again, but it is not destroyed the second time.
+ */
+static void
+coro_locals_destroy(struct coro *c)
+{
+	if (c->locals == NULL)
+		return;
+	for (int i = 0; i < CORO_KEY_MAX; ++i) {
+		void *value = c->locals[i];
+		void (*destructor)(void *) = coro_keys[i].destructor;
+		if (value == NULL || destructor == NULL)
+			continue;
+		c->locals[i] = NULL;
+		destructor(value);
+	}
+}
+
+void
+coro_set_hooks(const struct coro_hooks *hooks)
+{
+	__atomic_store_n(&coro_hooks_are_on, false, __ATOMIC_RELAXED);
+	if (hooks == NULL)
+		return;
+	coro_hooks = *hooks;
+	__atomic_store_n(&coro_hooks_are_on, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Coroutine entry point, the first function executed on its own
+ * stack. Runs the user function and never returns.
+ */
+static void
+coro_main(struct coro *c)
+{
+	coro_after_switch();
+	c->ret = c->func(c->func_arg);
+	if (__atomic_load_n(&coro_hooks_are_on, __ATOMIC_RELAXED) &&
+	    coro_hooks.finish != NULL)
+		coro_hooks.finish(c, coro_hooks.arg);
+	coro_locals_destroy(c);
+	c->is_finished = true;
+	__atomic_store_n(&c->state, CORO_STATE_FINISHED, __ATOMIC_RELAXED);
+	/*
+	 * Can not return - 'ret' address is invalid already! If
+	 * the scheduler waits, it is woken up right away to return
+	 * the coroutine to the user.
+	 */
+	struct coro_thread *t = coro_thread();
+	struct coro *to;
+	if (t->is_sched_waiting) {
+		to = &t->sched;
+		coro_queue_remove(&t->runq->queue, to);
+	} else {
+		coro_timers_check(t);
+		to = coro_runq_pop(t->runq);
+		if (to == NULL)
+			to = t->idle;
+	}
+	if (to == NULL) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	coro_switch(t, to, CORO_AFTER_FINISH, NULL);
+	abort();
 }
 
+#if CORO_CTX_SIGALTSTACK
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -160,42 +1536,28 @@ static void
 coro_body(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro_thread *t = coro_thread();
+	struct coro *c = t->this_ptr;
+	t->this_ptr = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
+	if (sigsetjmp(c->ctx.buf, 0) == 0)
 		siglongjmp(start_point, 1);
 	/*
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_main(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+static void
+coro_ctx_init(struct coro_ctx *ctx, void *stack, size_t size,
+	      void (*entry)(struct coro *), struct coro *arg)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
+	(void)ctx;
+	(void)entry;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -218,21 +1580,22 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_sp = stack;
+	newst.ss_size = size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	struct coro_thread *t = coro_thread();
+	struct coro *old_this = t->this_ptr;
+	t->this_ptr = arg;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (t->this_ptr != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
+	t->this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -251,8 +1614,328 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
+
+#endif /* CORO_CTX_SIGALTSTACK */
+
+#if CORO_CTX_ASM
+
+/** Let the sanitizer forget the frames it saw on a stack. */
+static inline void
+coro_stack_unpoison(void *ptr, size_t size)
+{
+#if CORO_ASAN
+	ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+#else
+	(void)ptr;
+	(void)size;
+#endif
+}
+
+/**
+ * Copy the used part of the shared stack of a switched out
+ * coroutine into its buffer. The buffer is right-sized, so it is
+ * shrunk too, when the coroutine uses much less than before.
+ */
+static void
+coro_stack_save(struct coro_thread *t, struct coro *c)
+{
+	char *top = (char *)t->shared_stack.base + t->shared_stack.size;
+	size_t size = top - (char *)c->ctx.sp;
+	size_t capacity = (size + CORO_STACK_COPY_ALIGN - 1) &
+			  ~(size_t)(CORO_STACK_COPY_ALIGN - 1);
+	if (capacity > c->stack_copy_capacity ||
+	    capacity < c->stack_copy_capacity / 4) {
+		free(c->stack_copy);
+		c->stack_copy = malloc(capacity);
+		if (c->stack_copy == NULL)
+			handle_error();
+		c->stack_copy_capacity = capacity;
+	}
+	coro_stack_unpoison(c->ctx.sp, size);
+	memcpy(c->stack_copy, c->ctx.sp, size);
+	c->stack_copy_size = size;
+}
 
+/**
+ * Entry of the copier context. Each time it is switched to, it
+ * saves the frames of the current occupant of the shared stack,
+ * puts the frames of the next coroutine in place, and continues
+ * that coroutine.
+ */
+static void
+coro_stack_copier(struct coro *unused)
+{
+	(void)unused;
+	while (true) {
+		struct coro_thread *t = coro_thread();
+		struct coro *to = t->copier_to;
+		struct coro *old = t->shared_occupant;
+		/* A finished one won't ever need its frames. */
+		if (old != NULL && ! old->is_finished)
+			coro_stack_save(t, old);
+		void *base = t->shared_stack.base;
+		size_t size = t->shared_stack.size;
+		coro_stack_unpoison(base, size);
+		if (to->ctx.sp == NULL) {
+			coro_ctx_init(&to->ctx, base, size, coro_main, to);
+		} else {
+			memcpy(to->ctx.sp, to->stack_copy, to->stack_copy_size);
+			to->stack_copy_size = 0;
+		}
+		t->shared_occupant = to;
+		coro_ctx_switch(&t->copier_ctx, &to->ctx);
+	}
+}
+
+/**
+ * Check, that the coroutine can use the shared stack of the
+ * current thread, and create the stack, if it is the first one.
+ */
+static bool
+coro_stack_share(const struct coro_attr *attr, size_t stack_size)
+{
+	if (! attr->stack_shared || attr->stack_probe ||
+	    coro_mt.worker_count > 0)
+		return false;
+	struct coro_thread *t = coro_thread();
+	if (t->shared_stack.base == NULL) {
+		if (stack_size < CORO_STACK_SIZE_DEFAULT)
+			stack_size = CORO_STACK_SIZE_DEFAULT;
+		coro_stack_create(&t->shared_stack, stack_size, false, true);
+		coro_stack_create(&t->copier_stack, CORO_COPIER_STACK_SIZE,
+				  false, true);
+		coro_ctx_init(&t->copier_ctx, t->copier_stack.base,
+			      t->copier_stack.size, coro_stack_copier, NULL);
+	}
+	return stack_size <= t->shared_stack.size;
+}
+
+#else /* ! CORO_CTX_ASM */
+
+static bool
+coro_stack_share(const struct coro_attr *attr, size_t stack_size)
+{
+	(void)attr;
+	(void)stack_size;
+	return false;
+}
+
+#endif /* ! CORO_CTX_ASM */
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	attr->stack_size = CORO_STACK_SIZE_DEFAULT;
+	attr->stack_probe = false;
+	attr->stack_guard = true;
+	attr->stack_shared = false;
+	attr->quantum_nsec = 0;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, NULL);
+}
+
+/** Create a coroutine in the group, if it is not NULL. */
+static struct coro *
+coro_create(coro_f func, void *func_arg, const struct coro_attr *attr,
+	    struct coro_group *g)
+{
+	struct coro_attr def;
+	if (attr == NULL) {
+		coro_attr_create(&def);
+		attr = &def;
+	}
+	size_t stack_size = attr->stack_size;
+	if (stack_size == 0)
+		stack_size = CORO_STACK_SIZE_DEFAULT;
+	if (stack_size < (size_t)SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		handle_error();
+	c->ret = 0;
+	c->is_stack_shared = coro_stack_share(attr, stack_size);
+	c->stack_copy = NULL;
+	c->stack_copy_size = 0;
+	c->stack_copy_capacity = 0;
+	if (! c->is_stack_shared)
+		coro_stack_create(&c->stack, stack_size, attr->stack_probe,
+				  attr->stack_guard);
+	else
+		memset(&c->stack, 0, sizeof(c->stack));
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->switch_count = 0;
+	c->quantum = 0;
+	coro_set_quantum(c, attr->quantum_nsec);
+	c->slice_start = 0;
+	c->work_time = 0;
+	c->ready_start = coro_clock_ticks();
+	c->ready_time = 0;
+	c->check_countdown = 0;
+	c->owner = coro_thread();
+	c->is_cancelled = false;
+	c->group = g;
+	c->group_next = c->group_prev = NULL;
+	c->locals = NULL;
+	c->next = c->prev = NULL;
+	/* A shared stack gets the first frame right before the start. */
+	if (c->is_stack_shared)
+		memset(&c->ctx, 0, sizeof(c->ctx));
+	else
+		coro_ctx_init(&c->ctx, c->stack.base, c->stack.size,
+			      coro_main, c);
+	if (g != NULL) {
+		coro_spinlock_lock(&g->lock);
+		c->group_next = g->first;
+		if (g->first != NULL)
+			g->first->group_prev = c;
+		g->first = c;
+		++g->live_count;
+		c->is_cancelled = g->is_cancelled;
+		coro_spinlock_unlock(&g->lock);
+	}
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	if (coro_mt.worker_count > 0)
+		__atomic_add_fetch(&coro_mt.live_count, 1, __ATOMIC_RELAXED);
+	coro_make_ready(coro_thread(), c);
 	return c;
 }
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	return coro_create(func, func_arg, attr, NULL);
+}
+
+void
+coro_cancel(struct coro *c)
+{
+	__atomic_store_n(&c->is_cancelled, true, __ATOMIC_RELAXED);
+	coro_wakeup(c);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *c = coro_thread()->this_ptr;
+	return c != NULL && __atomic_load_n(&c->is_cancelled, __ATOMIC_RELAXED);
+}
+
+struct coro_group *
+coro_group_new(void)
+{
+	struct coro_group *g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		handle_error();
+	coro_spinlock_create(&g->lock);
+	return g;
+}
+
+void
+coro_group_delete(struct coro_group *g)
+{
+	if (g->live_count != 0) {
+		printf("Critical error - the group is not joined!\n");
+		exit(-1);
+	}
+	free(g);
+}
+
+void
+coro_group_spawn(struct coro_group *g, coro_f func, void *func_arg,
+		 const struct coro_attr *attr)
+{
+	coro_create(func, func_arg, attr, g);
+}
+
+/** Cancel all the members. Called under the group lock. */
+static void
+coro_group_cancel_locked(struct coro_group *g)
+{
+	g->is_cancelled = true;
+	for (struct coro *c = g->first; c != NULL; c = c->group_next)
+		coro_cancel(c);
+}
+
+void
+coro_group_cancel(struct coro_group *g)
+{
+	coro_spinlock_lock(&g->lock);
+	coro_group_cancel_locked(g);
+	coro_spinlock_unlock(&g->lock);
+}
+
+/**
+ * A member has finished and is switched out for good. Account
+ * it in the group, cancel the rest on a failure, delete it, and
+ * wake up the joiner, if it was the last one.
+ */
+static void
+coro_group_finish(struct coro *c)
+{
+	struct coro_group *g = c->group;
+	coro_spinlock_lock(&g->lock);
+	if (c->group_prev != NULL)
+		c->group_prev->group_next = c->group_next;
+	else
+		g->first = c->group_next;
+	if (c->group_next != NULL)
+		c->group_next->group_prev = c->group_prev;
+	if (c->ret != 0 && g->status == 0) {
+		g->status = c->ret;
+		coro_group_cancel_locked(g);
+	}
+	coro_delete(c);
+	int live_count = __atomic_sub_fetch(&g->live_count, 1,
+					    __ATOMIC_RELEASE);
+	/*
+	 * The joiner can't leave, while the lock is held, so it is
+	 * still alive here.
+	 */
+	if (live_count == 0 && g->joiner != NULL)
+		coro_wakeup(g->joiner);
+	coro_spinlock_unlock(&g->lock);
+	if (coro_mt.worker_count > 0) {
+		pthread_mutex_lock(&coro_mt.lock);
+		__atomic_sub_fetch(&coro_mt.live_count, 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&coro_mt.finish_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+	}
+}
+
+int
+coro_group_join(struct coro_group *g)
+{
+	if (coro_is_inside()) {
+		coro_spinlock_lock(&g->lock);
+		while (g->live_count > 0) {
+			g->joiner = coro_this();
+			coro_wait_unlock(&g->lock);
+			coro_spinlock_lock(&g->lock);
+		}
+		g->joiner = NULL;
+		coro_spinlock_unlock(&g->lock);
+	} else if (coro_mt.worker_count > 0) {
+		pthread_mutex_lock(&coro_mt.lock);
+		while (__atomic_load_n(&g->live_count, __ATOMIC_ACQUIRE) > 0)
+			pthread_cond_wait(&coro_mt.finish_cond, &coro_mt.lock);
+		pthread_mutex_unlock(&coro_mt.lock);
+	} else if (coro_sched_run(g) == NULL && g->live_count > 0) {
+		printf("Critical error - the group can't finish, all "
+		       "coroutines are blocked!\n");
+		exit(-1);
+	}
+	/* The last member could still be releasing the lock. */
+	coro_spinlock_lock(&g->lock);
+	int status = g->status;
+	g->status = 0;
+	g->is_cancelled = false;
+	coro_spinlock_unlock(&g->lock);
+	return status;
+}
@@ -1,17 +1,109 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
+/** Coroutine creation attributes. */
+struct coro_attr {
+	/**
+	 * Stack size in bytes. It is rounded up to a page size. 0
+	 * means the default size.
+	 */
+	size_t stack_size;
+	/**
+	 * Fill the stack with a pattern on creation to be able to
+	 * get its max usage via coro_stack_usage(). Costs the whole
+	 * stack to be touched.
+	 */
+	bool stack_probe;
+	/**
+	 * Protect the stack bottom with a guard page. Each guarded
+	 * stack is a separate memory mapping, and the kernel limits
+	 * their count (vm.max_map_count), so for hundreds of
+	 * thousands of coroutines the guard has to be turned off.
+	 */
+	bool stack_guard;
+	/**
+	 * Run on a stack, shared by all such coroutines of the
+	 * thread, instead of an own one. When another coroutine
+	 * takes the shared stack, the used part of the current one
+	 * is copied aside into a buffer of the exact size, and is
+	 * copied back before it continues. A coroutine then costs a
+	 * few KB instead of a whole stack, at the price of a copy on
+	 * the switches between such coroutines. Pointers to the
+	 * stack variables should not be given to other coroutines.
+	 * Supported only by the assembly context switch without
+	 * worker threads, otherwise an own stack is used. Probing
+	 * is not supported.
+	 */
+	bool stack_shared;
+	/**
+	 * Time slice in nanoseconds, after which
+	 * coro_yield_if_expired() yields. 0 means no limit.
+	 */
+	long long quantum_nsec;
+};
+
+/**
+ * Spin lock to protect data, shared by coroutines on different
+ * worker threads. It should be held only for short sections
+ * without yields.
+ */
+struct coro_spinlock {
+	int is_locked;
+};
+
+void
+coro_spinlock_create(struct coro_spinlock *l);
+
+void
+coro_spinlock_lock(struct coro_spinlock *l);
+
+void
+coro_spinlock_unlock(struct coro_spinlock *l);
+
+/** Default coroutine stack size. */
+enum { CORO_STACK_SIZE_DEFAULT = 1024 * 1024 };
+
+/** Fill the attributes with the default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
 /**
- * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * Turn on M:N mode - run the coroutines on @a count worker
+ * threads, each with its own scheduler. Idle workers steal
+ * coroutines from the others. Should be called after
+ * coro_sched_init() before any coroutine is created. The calling
+ * thread then only creates coroutines and reaps them with
+ * coro_sched_wait(). Data shared between coroutines should be
+ * protected, for example with coro_sync.h primitives.
+ * @retval 0 Success.
+ * @retval -1 Invalid count, the mode is already on, the
+ *         context switch backend does not support threads, or no
+ *         memory.
+ */
+int
+coro_sched_start_workers(int count);
+
+/**
+ * Stop the worker threads, if any, and free the resources cached
+ * by the scheduler, such as unused coroutine stacks. All the
+ * coroutines should be deleted.
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Block until any coroutine has finished. It is returned. NULL,
+ * if no coroutines. When all the coroutines are suspended, it
+ * sleeps until another thread wakes up any of them.
  */
 struct coro *
 coro_sched_wait(void);
@@ -20,6 +112,13 @@ coro_sched_wait(void);
 struct coro *
 coro_this(void);
 
+/**
+ * True, if called from a coroutine. False in a scheduler and in
+ * threads not running coroutines.
+ */
+bool
+coro_is_inside(void);
+
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
@@ -27,6 +126,10 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Create a new coroutine with the given attributes. */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,6 +137,44 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Max number of stack bytes ever used by the coroutine. -1, if it
+ * was created without stack_probe attribute.
+ */
+long long
+coro_stack_usage(const struct coro *c);
+
+/**
+ * True, if the coroutine runs on the shared stack of its thread.
+ * Its stack memory is valid only while it is running then, so the
+ * objects, which others access while it is suspended, should be
+ * allocated elsewhere.
+ */
+bool
+coro_stack_is_shared(const struct coro *c);
+
+/**
+ * Total time in nanoseconds the coroutine was running, not
+ * counting the time it was waiting for its turn or suspended.
+ */
+long long
+coro_work_time(const struct coro *c);
+
+/**
+ * Total time in nanoseconds the coroutine was ready to run, but
+ * was waiting for its turn in a ready queue. The time suspended in
+ * coro_wait() is not counted.
+ */
+long long
+coro_ready_time(const struct coro *c);
+
+/**
+ * Set a time slice of the coroutine in nanoseconds. 0 means no
+ * limit.
+ */
+void
+coro_set_quantum(struct coro *c, long long nsec);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -42,6 +183,195 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to the next coroutine ready to run. Blocked ones are
+ * skipped. If there are none, returns right away.
+ */
 void
 coro_yield(void);
+
+/**
+ * Suspend the current coroutine until coro_wakeup() is called for
+ * it. The suspended coroutine costs nothing to the scheduler.
+ * Wakeups can be spurious, so the caller should check its
+ * condition again after return. Can't be used by the thread,
+ * which started workers.
+ */
+void
+coro_wait(void);
+
+/**
+ * Make a coroutine, suspended by coro_wait(), ready to run. It is
+ * put into the end of the ready queue. If the coroutine is still
+ * running, its next coro_wait() returns right away. Can be called
+ * from any thread, even from the one not running coroutines.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Yield, if the current coroutine has used up its time slice
+ * since it was resumed. It is cheap enough to be called in
+ * tight loops - the clock is a CPU counter, or it is read only
+ * once in several calls. Return true, if yielded.
+ */
+bool
+coro_yield_if_expired(void);
+
+/**
+ * Same as coro_wait(), but release @a l once the coroutine is
+ * suspended. So a wakeup, sent by somebody under the same lock,
+ * can not be lost.
+ */
+void
+coro_wait_unlock(struct coro_spinlock *l);
+
+/**
+ * Current time of CLOCK_MONOTONIC in nanoseconds. The deadlines
+ * are in it.
+ */
+long long
+coro_now_nsec(void);
+
+/**
+ * Same as coro_wait(), but wake up by itself, when coro_now_nsec()
+ * reaches @a deadline. The timers have a resolution of about
+ * 65 us, and never fire early. Return false, if the deadline has
+ * come before any other wakeup.
+ */
+bool
+coro_wait_deadline(long long deadline);
+
+/** Same as coro_wait_unlock() with a deadline. */
+bool
+coro_wait_unlock_deadline(struct coro_spinlock *l, long long deadline);
+
+/**
+ * Suspend the current coroutine for at least @a nsec. Others run
+ * meanwhile, and when all of them sleep, the thread sleeps in the
+ * kernel until the nearest timer. Outside of coroutines just
+ * sleeps the thread.
+ */
+void
+coro_sleep(long long nsec);
+
+/** Max number of coroutine-local storage keys. */
+enum { CORO_KEY_MAX = 16 };
+
+/**
+ * Create a key of coroutine-local storage. Like a pthread key,
+ * but each coroutine has an own value of it, NULL initially. The
+ * values need no work on the switches. @a destructor, if not
+ * NULL, is called for a non-NULL value, when the coroutine's
+ * function returns.
+ * @retval 0 Success, the key is stored into @a key.
+ * @retval -1 All the keys are taken.
+ */
+int
+coro_key_create(int *key, void (*destructor)(void *));
+
+/**
+ * Free the key. The values are not destroyed, and should not be
+ * accessed by the key anymore.
+ */
+void
+coro_key_delete(int key);
+
+/**
+ * Value of the key in the current coroutine. In a scheduler or a
+ * thread without coroutines the thread has an own value.
+ */
+void *
+coro_local_get(int key);
+
+void
+coro_local_set(int key, void *value);
+
+/**
+ * Scheduler hooks, to attach profilers, allocators or tracing.
+ * Any of them can be NULL. They are called only for coroutines,
+ * not for schedulers, and should not switch themselves.
+ */
+struct coro_hooks {
+	/**
+	 * The coroutine has got control, and is about to continue.
+	 * Called in it.
+	 */
+	void (*switch_in)(struct coro *c, void *arg);
+	/**
+	 * The coroutine is about to give control away: yield, wait
+	 * or be preempted. Called in it. Not called, when it
+	 * finishes.
+	 */
+	void (*switch_out)(struct coro *c, void *arg);
+	/**
+	 * The function of the coroutine has returned, its status
+	 * is known. Called in it before the local storage
+	 * destructors.
+	 */
+	void (*finish)(struct coro *c, void *arg);
+	/** Argument of the hooks. */
+	void *arg;
+};
+
+/**
+ * Set the hooks of all the threads, or remove them with NULL. The
+ * structure is copied. Should be called while no coroutines run.
+ * Without hooks a switch costs one extra branch.
+ */
+void
+coro_set_hooks(const struct coro_hooks *hooks);
+
+/**
+ * Ask the coroutine to stop. It is woken up, if it waits, and
+ * coro_is_cancelled() becomes true in it. How to stop, is up to
+ * the coroutine - the functions, which can wait long, like
+ * coro_sleep() or the channels, return early in a cancelled one.
+ * Can be called from any thread.
+ */
+void
+coro_cancel(struct coro *c);
+
+/** Check if the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
+/**
+ * Group of coroutines to fan out work and join it. A member is
+ * deleted right when it finishes, so the group never keeps
+ * finished coroutines and their stacks. The first member, which
+ * returns non-zero, cancels the others.
+ */
+struct coro_group;
+
+struct coro_group *
+coro_group_new(void);
+
+/** Free the group. It should have no running members. */
+void
+coro_group_delete(struct coro_group *g);
+
+/**
+ * Create a coroutine in the group. @a attr can be NULL for the
+ * default attributes. The members are not returned, since they
+ * are deleted by the group. If the group is cancelled, the new
+ * member starts cancelled.
+ */
+void
+coro_group_spawn(struct coro_group *g, coro_f func, void *func_arg,
+		 const struct coro_attr *attr);
+
+/** Cancel all the members, and the ones spawned until the join. */
+void
+coro_group_cancel(struct coro_group *g);
+
+/**
+ * Wait until all the members finish. Works inside a coroutine, or
+ * outside like coro_sched_wait(), which runs the scheduler. The
+ * finished coroutines of the other groups and without a group
+ * are left for coro_sched_wait(). The group can be used again
+ * after the join.
+ * @return Status of the first failed member, or 0.
+ */
+int
+coro_group_join(struct coro_group *g);
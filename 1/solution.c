@@ -3,27 +3,99 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <glob.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include "libcoro.h"
+#include "coro_sync.h"
+#include "coro_io.h"
+#include "int_scan.h"
+#include "int_print.h"
+#include "int_bin.h"
+#include "int_merge.h"
+#include "int_sort.h"
+#include "ext_sort.h"
+#include "sort_prof.h"
+
+/** How much of a file is parsed between the yield checks. */
+#define PARSE_CHUNK_SIZE (1 << 20)
+/** How many numbers are merged at once before they are written. */
+#define MERGE_CHUNK_SIZE (64 * 1024)
+/**
+ * Memory of the program itself - code, stacks, buffers of the
+ * coroutines - which is not given to the external sort from the
+ * --mem-limit budget
+ */
+#define MEM_LIMIT_RESERVE (8 << 20)
+
+/**
+ * Formats of the written files: text, or a binary run with fixed
+ * width or delta encoded numbers
+ */
+enum outputFormat {
+	FORMAT_TEXT,
+	FORMAT_BIN,
+	FORMAT_DELTA,
+};
 
 struct my_context {
 	char *name;
 	long quantum;
 	struct sortedArray* all_sorted;
-	int* num_remaining_files;
-	int total_num_files;
+	/** The files to sort. */
+	struct inputFile* inputs;
+	/** Queue of indexes of the files waiting to be sorted. */
+	struct coro_chan* files;
 	int index;
+	/** Format of the written files. */
+	enum outputFormat format;
+	/** Memory budget of the external sort, 0 if it is off. */
+	size_t mem_budget;
+	/** Sorted runs of all the files, for the external sort. */
+	struct ext_run_list* all_runs;
+	struct coro_mutex* all_runs_lock;
+	/** Where the coroutine and its files record their times. */
+	struct sort_prof* prof;
+	/** When the coroutine was created. */
+	struct timespec start_time;
 };
 
 static struct my_context *
-my_context_new(const char *name, int index, long* quantum, struct sortedArray* all_sorted, int* num_remaining_files, int total_num_files)
+my_context_new(const char *name, int index, long* quantum, struct sortedArray* all_sorted,
+	struct inputFile* inputs, struct coro_chan* files, enum outputFormat format,
+	size_t mem_budget, struct ext_run_list* all_runs, struct coro_mutex* all_runs_lock,
+	struct sort_prof* prof)
 {
 	struct my_context *ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
 	ctx -> name = strdup(name);
+	if (ctx -> name == NULL)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
 	ctx -> quantum = *quantum;
 	ctx -> all_sorted = all_sorted;
-	ctx ->  num_remaining_files = num_remaining_files;
-	ctx -> total_num_files = total_num_files;
+	ctx -> inputs = inputs;
+	ctx -> files = files;
 	ctx -> index = index;
+	ctx -> format = format;
+	ctx -> mem_budget = mem_budget;
+	ctx -> all_runs = all_runs;
+	ctx -> all_runs_lock = all_runs_lock;
+	ctx -> prof = prof;
+	clock_gettime(CLOCK_MONOTONIC, &ctx->start_time);
 
 	return ctx;
 }
@@ -44,7 +116,6 @@ my_context_delete(struct my_context *ctx)
 struct sortedArray {
 	int* arr;
 	int length;
-	bool sorted;
 };
 
 /**
@@ -59,164 +130,526 @@ struct sortedArray {
 // }
 
 /**
- * A function that parses a string of whitespace-separated integers
- * into an array of integers given as its first parameter
- * P.S: make sure first param has enough memory
+ * A struct that holds an input file and its size
+ */
+struct inputFile {
+	char* path;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+};
+
+/**
+ * A struct that holds the list of input files
+ */
+struct fileList {
+	struct inputFile* files;
+	int count;
+	int capacity;
+};
+
+/**
+ * A function that adds a regular file to the list given its path and
+ * stat. A file, which is already in the list or is the output file,
+ * is skipped, so it is not sorted twice or read while it is written
  */
 static void
-parse_string_into_array(int* numbers, char* input)
+add_input_file(struct fileList* list, const char* path, struct stat* st, struct stat* output_st)
 {
-	char* token;
-	int index = 0;
+	if (output_st != NULL && st->st_dev == output_st->st_dev && st->st_ino == output_st->st_ino)
+		return;
 
-	static const char delim = ' ';
+	for (int i = 0; i < list->count; i++)
+	{
+		if (list->files[i].dev == st->st_dev && list->files[i].ino == st->st_ino)
+			return;
+	}
 
-	token = strtok(input, &delim);
+	if (list->count == list->capacity)
+	{
+		list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+		list->files = realloc(list->files, list->capacity * sizeof(*list->files));
+		if (list->files == NULL)
+		{
+			printf("Error: out of memory\n");
+			exit(1);
+		}
+	}
 
-	while( token != NULL )
+	struct inputFile* file = &list->files[list->count++];
+	file->path = strdup(path);
+	if (file->path == NULL)
 	{
-		numbers[index] = atoi(token);
-		token = strtok(NULL, &delim);
-		index ++;
+		printf("Error: out of memory\n");
+		exit(1);
 	}
+	file->size = st->st_size;
+	file->dev = st->st_dev;
+	file->ino = st->st_ino;
 }
 
 /**
- * A function that returns the number of integers separated by whitespaces
- * in a string given as its parameter
+ * A function that adds all the regular files of a directory to the
+ * list. Hidden files and subdirectories are skipped
  */
-static int
-get_string_num_count(char* input)
+static void
+add_input_dir(struct fileList* list, const char* dir_path, struct stat* output_st)
 {
-	static const char delim = ' ';
-	int num_count = 0;
+	DIR* dir = opendir(dir_path);
+	struct dirent* entry;
+
+	if(dir == NULL) {
+		printf("Error: could not open directory %s\n", dir_path);
+		exit(1);
+	}
+
+	while((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		size_t path_size = strlen(dir_path) + strlen(entry->d_name) + 2;
+		char* path = malloc(path_size);
+		if (path == NULL)
+		{
+			printf("Error: out of memory\n");
+			exit(1);
+		}
+		snprintf(path, path_size, "%s/%s", dir_path, entry->d_name);
+
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			add_input_file(list, path, &st, output_st);
+
+		free(path);
+	}
+
+	closedir(dir);
+}
 
-	for (int i = 0; input[i] != '\0'; i++) 
+/**
+ * A function that adds the files given by a command line argument to
+ * the list. It can be a file, a directory or a glob pattern, which is
+ * expanded here in case the shell did not do it (when it is quoted)
+ */
+static void
+add_input_arg(struct fileList* list, const char* arg, struct stat* output_st)
+{
+	struct stat st;
+
+	if (stat(arg, &st) != 0)
+	{
+		if (strpbrk(arg, "*?[") == NULL)
+		{
+			printf("Error: could not find file %s\n", arg);
+			exit(1);
+		}
+
+		glob_t matches;
+		if (glob(arg, 0, NULL, &matches) != 0)
+		{
+			printf("Error: no files match %s\n", arg);
+			exit(1);
+		}
+
+		for (size_t i = 0; i < matches.gl_pathc; i++)
+		{
+			if (stat(matches.gl_pathv[i], &st) != 0)
+				continue;
+			if (S_ISDIR(st.st_mode))
+				add_input_dir(list, matches.gl_pathv[i], output_st);
+			else if (S_ISREG(st.st_mode))
+				add_input_file(list, matches.gl_pathv[i], &st, output_st);
+		}
+
+		globfree(&matches);
+	}
+	else if (S_ISDIR(st.st_mode))
 	{
-		if (input[i] == delim)
-     	{
-          num_count ++;
-     	}
+		add_input_dir(list, arg, output_st);
+	}
+	else
+	{
+		add_input_file(list, arg, &st, output_st);
+	}
+}
+
+/**
+ * A function that orders the files from the largest to the smallest,
+ * so the coroutines take the big ones first and none of them is left
+ * with a big file in the end, when the others are idle. Insertion
+ * sort, there are few files
+ */
+static void
+sort_input_files(struct fileList* list)
+{
+	for (int i = 1; i < list->count; i++)
+	{
+		struct inputFile file = list->files[i];
+		int j = i - 1;
+		while (j >= 0 && list->files[j].size < file.size)
+		{
+			list->files[j + 1] = list->files[j];
+			j--;
+		}
+		list->files[j + 1] = file;
 	}
+}
+
+/**
+ * A function that checks if a string consists only of digits
+ */
+static int
+is_number(const char* str)
+{
+	if (*str == '\0')
+		return 0;
 
-	num_count ++;
+	for (; *str != '\0'; str++)
+	{
+		if (*str < '0' || *str > '9')
+			return 0;
+	}
 
-	return num_count;
+	return 1;
 }
 
 /**
- * A function that returns the number of bytes present in a file given
- * its name
+ * A function that decodes a binary run, mapped into memory, into dst
+ * with space for capacity numbers, or into a new array if dst is NULL.
+ * Returns the array and its length, and if it is sorted. NULL if the
+ * numbers don't fit into dst
  */
-static long
-get_file_num_bytes(char* file_name)
+static int*
+read_binary_run(char* file_name, const char* data, size_t size, int* dst, size_t capacity,
+	int* length, int* is_sorted)
 {
-	FILE* fp;
-	long num_bytes;
+	struct int_bin_reader reader;
+
+	if (int_bin_reader_create(&reader, data, size) != 0)
+	{
+		printf("Error: file %s is not a valid binary run\n", file_name);
+		exit(1);
+	}
+
+	// The count is checked to fit the file, but can still be too
+	// big for the length
+	size_t count = reader.header.count;
+	if (count > INT_MAX)
+	{
+		printf("Error: file %s has too many numbers\n", file_name);
+		exit(1);
+	}
 
-	fp = fopen(file_name, "r");
+	if (dst != NULL && count > capacity)
+		return NULL;
 
-	if(fp == NULL)
+	int* numbers = dst;
+	if (numbers == NULL)
+		numbers = malloc((count > 0 ? count : 1) * sizeof(int));
+	if (numbers == NULL)
 	{
-		printf("Error: could not open file %s\n", file_name);
+		printf("Error: out of memory for file %s\n", file_name);
 		exit(1);
 	}
+	size_t pos = 0;
+	size_t chunk_size;
 
-	fseek(fp, 0, SEEK_END);
-	num_bytes = ftell(fp);
+	while ((chunk_size = int_bin_reader_next(&reader, numbers + pos, PARSE_CHUNK_SIZE)) > 0)
+	{
+		pos += chunk_size;
+		coro_yield_if_expired();
+	}
+
+	if (int_bin_reader_check(&reader) != 0)
+	{
+		printf("Error: file %s is damaged\n", file_name);
+		exit(1);
+	}
 
-	fclose(fp);
+	// The sorted flag is verified by the check, so it can be trusted
+	*length = count;
+	if (is_sorted != NULL)
+		*is_sorted = (reader.header.flags & INT_BIN_SORTED) != 0;
 
-	return num_bytes;
+	return numbers;
 }
 
 /**
- * A function that returns the number of files starting 'test' in cwd
+ * A function that reads the integers from a file given its name into
+ * a new array, and returns it and its length. The file is mapped into
+ * memory and parsed in a single pass, without copying. If it can't be
+ * mapped, it is read in chunks. The parsing yields once the coroutine's
+ * time slice is over. The read and parse times are added to prof. When
+ * the file is mapped, the reading is done by the page faults in the
+ * parse phase. A binary run is decoded instead, and is_sorted tells
+ * if its numbers are known to be sorted already. If dst is not NULL,
+ * the numbers are read right into it, and NULL is returned if the
+ * file can have more than capacity numbers
  */
-static int
-count_test_files() {
-	DIR* dir;
-	struct dirent* entry;
-	int count = 0;
+static int*
+read_numbers_to(char *file_name, int* dst, size_t capacity, int* length, int* is_sorted,
+	struct sort_prof_file* prof)
+{
+	struct sort_prof_mark mark;
+	sort_prof_mark(&mark);
 
-	dir = opendir(".");
+	int fd = coro_open(file_name, O_RDONLY, 0);
+	struct stat st;
 
-	if(dir == NULL) {
-		printf("Error: could not open directory\n");
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("Error: could not open file %s\n", file_name);
 		exit(1);
 	}
 
-	while((entry = readdir(dir)) != NULL) {
-		if(strncmp(entry->d_name, "test", 4) == 0) {
-			count ++;
+	// A number takes 2 bytes at least with a separator, so the scanner
+	// never grows dst while the text is within the bound
+	struct int_scanner scanner;
+	int_scanner_create(&scanner);
+	scanner.data = dst;
+	scanner.capacity = capacity;
+
+	char* text = st.st_size > 0 ?
+		mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+	if (is_sorted != NULL)
+		*is_sorted = 0;
+
+	if (text != MAP_FAILED && int_bin_is_run(text, st.st_size))
+	{
+		madvise(text, st.st_size, MADV_SEQUENTIAL);
+		sort_prof_add(&prof->phases[SORT_PHASE_READ], &mark);
+		int* numbers = read_binary_run(file_name, text, st.st_size, dst, capacity, length, is_sorted);
+		munmap(text, st.st_size);
+		close(fd);
+		sort_prof_add(&prof->phases[SORT_PHASE_PARSE], &mark);
+		if (numbers != NULL)
+			prof->count = *length;
+		return numbers;
+	}
+
+	if (dst != NULL && text != MAP_FAILED && ((size_t)st.st_size + 1) / 2 > capacity)
+	{
+		munmap(text, st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	if (text != MAP_FAILED)
+	{
+		madvise(text, st.st_size, MADV_SEQUENTIAL);
+		sort_prof_add(&prof->phases[SORT_PHASE_READ], &mark);
+		for (off_t pos = 0; pos < st.st_size; pos += PARSE_CHUNK_SIZE)
+		{
+			off_t size = st.st_size - pos;
+			if (size > PARSE_CHUNK_SIZE)
+				size = PARSE_CHUNK_SIZE;
+			int_scanner_feed(&scanner, text + pos, size);
+			coro_yield_if_expired();
 		}
+		munmap(text, st.st_size);
+		sort_prof_add(&prof->phases[SORT_PHASE_PARSE], &mark);
+	}
+	else
+	{
+		char* buffer = malloc(PARSE_CHUNK_SIZE);
+		if (buffer == NULL)
+		{
+			printf("Error: out of memory\n");
+			exit(1);
+		}
+		ssize_t rc;
+		size_t total = 0;
+		while ((rc = coro_read(fd, buffer, PARSE_CHUNK_SIZE)) > 0)
+		{
+			sort_prof_add(&prof->phases[SORT_PHASE_READ], &mark);
+			total += rc;
+			if (dst != NULL && (total + 1) / 2 > capacity)
+			{
+				free(buffer);
+				close(fd);
+				return NULL;
+			}
+			int_scanner_feed(&scanner, buffer, rc);
+			sort_prof_add(&prof->phases[SORT_PHASE_PARSE], &mark);
+		}
+		if (rc < 0)
+		{
+			printf("Error: could not read file %s\n", file_name);
+			exit(1);
+		}
+		free(buffer);
 	}
 
-	closedir(dir);
-	return count;
+	close(fd);
+
+	size_t count;
+	int* numbers = int_scanner_finish(&scanner, &count);
+	if (scanner.is_out_of_memory)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+	*length = count;
+	prof->count = count;
+
+	return numbers;
+}
+
+/**
+ * A function that reads the integers from a file given its name into
+ * a new array, see read_numbers_to()
+ */
+static int*
+read_numbers(char *file_name, int* length, int* is_sorted, struct sort_prof_file* prof)
+{
+	return read_numbers_to(file_name, NULL, 0, length, is_sorted, prof);
 }
 
 /**
- * A function that reads a file given its name and its number of bytes
- * into a buffer given as its first paramter
+ * A struct that writes numbers to a file in any of the formats
  */
-static char*
-read_file(char* buffer, char *file_name, long num_bytes)
+struct numberWriter {
+	enum outputFormat format;
+	struct int_printer printer;
+	struct int_bin_writer bin;
+};
+
+static void
+number_writer_create(struct numberWriter* writer, int fd, enum outputFormat format)
 {
-	FILE* fp;
+	writer->format = format;
+	if (format == FORMAT_TEXT)
+		int_printer_create(&writer->printer, fd);
+	else
+		int_bin_writer_create(&writer->bin, fd, format == FORMAT_BIN ? INT_BIN_FIXED : INT_BIN_DELTA);
+}
 
-	fp = fopen(file_name, "r");
+static void
+number_writer_put(struct numberWriter* writer, const int* values, size_t count)
+{
+	if (writer->format == FORMAT_TEXT)
+		int_printer_put(&writer->printer, values, count);
+	else
+		int_bin_writer_put(&writer->bin, values, count);
+}
 
-	if(fp == NULL)
+/**
+ * A function that finishes writing, returns 0 on success and -1 on
+ * an error
+ */
+static int
+number_writer_destroy(struct numberWriter* writer)
+{
+	if (writer->format == FORMAT_TEXT)
+		return int_printer_destroy(&writer->printer);
+	return int_bin_writer_destroy(&writer->bin);
+}
+
+/**
+ * A function that writes an array of integers to a file given
+ * its name, the array to be written, its length and the format
+ */
+static void
+write_file(char* file_name, int* content, int content_length, enum outputFormat format)
+{
+	int fd = coro_open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if(fd < 0)
 	{
 		printf("Error: could not open file %s\n", file_name);
 		exit(1);
 	}
 
-	fread(buffer, sizeof(char), num_bytes, fp);
+	struct numberWriter writer;
+	number_writer_create(&writer, fd, format);
+	number_writer_put(&writer, content, content_length);
+
+	if (number_writer_destroy(&writer) != 0)
+	{
+		printf("Error: could not write file %s\n", file_name);
+		exit(1);
+	}
 
-	fclose(fp);
+	printf("Success: wrote to file %s\n", file_name);
 
-	return buffer;
+	close(fd);
 }
 
 /**
- * A function that writes an array of integers to a file given
- * its name, the array to be written, and its length
+ * A function that merges sorted arrays given the arrays and their
+ * count, and writes the result to a file given its name. The numbers
+ * go straight from the merge to the file by chunks, without
+ * collecting the whole result in memory
  */
 static void
-write_file(char* file_name, int* content, int content_length)
+write_merged_file(char* file_name, struct sortedArray* arrays, int count, enum outputFormat format)
 {
-	FILE* fp;
-
-	fp = fopen(file_name, "w");
+	int fd = coro_open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-	if(fp == NULL)
+	if(fd < 0)
 	{
 		printf("Error: could not open file %s\n", file_name);
 		exit(1);
 	}
 
-	for(int i = 0; i < content_length; i++)
+	struct int_run* runs = malloc((count > 0 ? count : 1) * sizeof(*runs));
+	int* chunk = malloc(MERGE_CHUNK_SIZE * sizeof(int));
+	if (runs == NULL || chunk == NULL)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < count; i++)
+	{
+		runs[i].data = arrays[i].arr;
+		runs[i].size = arrays[i].length;
+	}
+
+	struct int_merger merger;
+	if (int_merger_create(&merger, runs, count) != 0)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+
+	struct numberWriter writer;
+	number_writer_create(&writer, fd, format);
+
+	size_t chunk_size;
+	while ((chunk_size = int_merger_next(&merger, chunk, MERGE_CHUNK_SIZE)) > 0)
+		number_writer_put(&writer, chunk, chunk_size);
+
+	if (number_writer_destroy(&writer) != 0)
 	{
-		fprintf(fp, "%d ", content[i]);
+		printf("Error: could not write file %s\n", file_name);
+		exit(1);
 	}
 
 	printf("Success: wrote to file %s\n", file_name);
 
-	fclose(fp);
+	free(chunk);
+	int_merger_destroy(&merger);
+	free(runs);
+	close(fd);
 }
 
 /**
- * A function that appends one array to another given the arrays
- * and their lengths as parameters
- * P.S: make sure first param has enough memory
+ * A function that converts a file with numbers in any format to
+ * text, for the tools which can't read the binary runs
  */
 static void
-append_array(int* arr_1, int length_1, int* arr_2, int length_2)
-{	
-	for (int i = 0; i < length_2; i ++)
-		arr_1[i + length_1] = arr_2[i];
+export_text(char* in_name, char* out_name)
+{
+	struct sort_prof_file prof;
+	memset(&prof, 0, sizeof(prof));
+
+	int num_items;
+	int is_sorted;
+	int* numbers = read_numbers(in_name, &num_items, &is_sorted, &prof);
+
+	write_file(out_name, numbers, num_items, FORMAT_TEXT);
+	free(numbers);
 }
 
 /**
@@ -235,125 +668,447 @@ get_time_diff_nsec(struct timespec *end, struct timespec *start)
 }
 
 /**
- * The merge part of merge sort
+ * A function that returns the number count from the header of a
+ * binary run given its file name, or -1 if the file is not one. A
+ * count, which can't fit the file, is not trusted either, the file
+ * is rejected when it is read
  */
-void
-merge_and_sort(int* arr, int l, int m, int r)
+static long long
+binary_run_count(char* file_name)
 {
+	struct int_bin_header header;
+	struct stat st;
+	int fd = coro_open(file_name, O_RDONLY, 0);
+
+	if (fd < 0)
+		return -1;
+
+	int is_binary = fstat(fd, &st) == 0 &&
+		read(fd, &header, sizeof(header)) == sizeof(header) &&
+		int_bin_is_run(&header, sizeof(header)) &&
+		header.count <= (uint64_t)st.st_size;
+	close(fd);
+
+	return is_binary ? (long long)header.count : -1;
+}
+
+// Sorting a single file
 
-	int arr1_size = m - l + 1;
-	int arr2_size = r - m;
-	int arr1[arr1_size], arr2[arr2_size], i = 0, j = 0, k = l;
+/**
+ * A function that takes a file name, opens the file and sorts its
+ * content writes the result back to the file in the given format,
+ * and to a sortedArray struct given as a parameter. A binary run,
+ * which is sorted already, is not sorted again
+ */
+static void
+sort_file (char* file_name, struct sortedArray* file_sort_res, enum outputFormat format,
+	struct sort_prof_file* prof)
+{
+	int num_items;
+	int is_sorted;
+	int* numbers = read_numbers(file_name, &num_items, &is_sorted, prof);
 
-	for (int i = 0; i < arr1_size; i++)
-		arr1[i] = arr[l + i];
-	for (int i = 0; i < arr2_size; i++)
-		arr2[i] = arr[m + 1 + i];
+	struct sort_prof_mark mark;
+	sort_prof_mark(&mark);
 
-	while (i < arr1_size && j < arr2_size)
+	if (!is_sorted && int_sort(numbers, num_items, INT_SORT_AUTO) != 0)
 	{
-		if (arr1[i] <= arr2[j]) 
-		{
-			arr[k] = arr1[i];
-			i++;
-		} else 
-		{
-			arr[k] = arr2[j];
-			j++;
-		}
-		k++;
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+	sort_prof_add(&prof->phases[SORT_PHASE_SORT], &mark);
+
+	write_file(file_name, numbers, num_items, format);
+	sort_prof_add(&prof->phases[SORT_PHASE_WRITE], &mark);
+
+	file_sort_res->arr = numbers;
+	file_sort_res->length = num_items;
+}
+
+/**
+ * A function that sorts a file, which might not fit into memory,
+ * using at most mem_budget bytes. The file is sorted by runs into
+ * temporary files, which are merged back into it. Then the runs are
+ * added to all_runs, to be merged once more into the final result
+ */
+static void
+sort_file_external(char* file_name, struct my_context* ctx, struct sort_prof_file* prof)
+{
+	struct ext_run_list runs;
+	ext_run_list_create(&runs);
+
+	if (binary_run_count(file_name) >= 0)
+	{
+		printf("Error: could not sort file %s: binary runs are not supported with --mem-limit\n", file_name);
+		exit(1);
 	}
 
-	while (i < arr1_size)
+	if (ext_sort_runs(file_name, ctx->mem_budget, &runs, prof->phases) != 0)
 	{
-		arr[k] = arr1[i];
-		i++;
-		k++;
+		printf("Error: could not sort file %s: %s\n", file_name, strerror(errno));
+		exit(1);
+	}
+
+	for (int i = 0; i < runs.count; i++)
+		prof->count += runs.runs[i].size;
+
+	struct sort_prof_mark mark;
+	sort_prof_mark(&mark);
+
+	int fd = coro_open(file_name, O_WRONLY | O_TRUNC, 0);
+
+	if (fd < 0 || ext_merge_text(&runs, ctx->mem_budget, fd) != 0)
+	{
+		printf("Error: could not write file %s: %s\n", file_name, strerror(errno));
+		exit(1);
 	}
 
-	while (j < arr2_size)
+	printf("Success: wrote to file %s\n", file_name);
+	close(fd);
+	sort_prof_add(&prof->phases[SORT_PHASE_WRITE], &mark);
+
+	coro_mutex_lock(ctx->all_runs_lock);
+	int rc = ext_run_list_move(ctx->all_runs, &runs);
+	coro_mutex_unlock(ctx->all_runs_lock);
+	if (rc != 0)
 	{
-		arr[k] = arr2[j];
-		j++;
-		k++;
+		ext_run_list_destroy(&runs);
+		printf("Error: out of memory\n");
+		exit(1);
 	}
 }
 
 /**
- * Merge sort + time measurements
+ * A function that parses a memory size like 64M, with an optional
+ * K, M or G suffix, into bytes. Returns 0 if it is invalid
  */
-void
-merge_sort(int* arr, int l, int r, long* quantum, struct timespec *start, long *time_taken)
-{	
+static size_t
+parse_mem_size(const char* str)
+{
+	char* end;
+	unsigned long long size = strtoull(str, &end, 10);
 
-	if (l < r)
+	if (end == str)
+		return 0;
+
+	switch (*end)
 	{
-		int m = l + (r - l) / 2;
+		case 'G': case 'g':
+			size <<= 10;
+			// fallthrough
+		case 'M': case 'm':
+			size <<= 10;
+			// fallthrough
+		case 'K': case 'k':
+			size <<= 10;
+			end++;
+			break;
+	}
+
+	if (*end != '\0')
+		return 0;
+
+	return size;
+}
+
+// Parallel mode
 
-		merge_sort(arr, l, m, quantum, start, time_taken);
-		merge_sort(arr, m + 1, r, quantum, start, time_taken);
+/**
+ * A struct that is shared by the workers of the parallel mode. It
+ * lives in a shared mapping, so the forked workers see it as well.
+ * Each file has a slot in two buffers of numbers, with room for the
+ * most numbers its size can hold. The sorted files are merged by a
+ * tree over the slots: a node of the level L covers 2^L slots, its
+ * numbers are in the buffer L % 2 from the offset of its first slot
+ */
+struct parallelShared {
+	/** Index of the next file to sort. */
+	int next_file;
+	/** Set if any worker has failed. */
+	int failed;
+	int num_files;
+	/** Format of the written files. */
+	enum outputFormat format;
+	/** Number of levels above the files in the merge tree. */
+	int height;
+	/**
+	 * Phase times of each file. They are here and not in the
+	 * profile, so the processes can fill them too
+	 */
+	struct sort_prof_file* prof_files;
+	/** Numbers in each file, once it is sorted. */
+	int* counts;
+	/** First slot of each file in the buffers. */
+	size_t* offsets;
+	/** How many children of each node are done, by level. */
+	int* node_done[32];
+	int* buffers[2];
+};
 
-		merge_and_sort(arr, l, m, r);
+/**
+ * A struct that holds the arguments of a parallel worker
+ */
+struct parallelWorker {
+	struct parallelShared* shared;
+	struct inputFile* inputs;
+	pthread_t thread;
+};
 
-		struct timespec *end = malloc(sizeof(*end));
-		clock_gettime(CLOCK_MONOTONIC, end);
+/**
+ * A function that returns the number of numbers in a merge tree node
+ */
+static size_t
+parallel_node_count(struct parallelShared* shared, int level, int node)
+{
+	size_t count = 0;
+	int end = (node + 1) << level;
+	for (int i = node << level; i < end && i < shared->num_files; i++)
+		count += shared->counts[i];
+	return count;
+}
 
-		long time_diff_nsec = get_time_diff_nsec(end, start);
+/**
+ * A function that moves a sorted file up the merge tree as far as
+ * it can go. When both children of a node are done, the one who
+ * finished last merges them, so the merges start as soon as the
+ * pairs are ready and run in parallel on different workers
+ */
+static void
+parallel_merge_up(struct parallelShared* shared, int slot)
+{
+	int node = slot;
+	for (int level = 0; level < shared->height; level++, node /= 2)
+	{
+		int left = node & ~1;
+		int right = node | 1;
+		size_t offset = shared->offsets[left << level];
+		int* src = shared->buffers[level % 2] + offset;
+		int* dst = shared->buffers[(level + 1) % 2] + offset;
+
+		// No pair - just move up to the next buffer
+		if ((right << level) >= shared->num_files)
+		{
+			memcpy(dst, src, parallel_node_count(shared, level, left) * sizeof(int));
+			continue;
+		}
 
+		// The pair is not ready yet - whoever finishes it goes on
+		if (__atomic_fetch_add(&shared->node_done[level + 1][node / 2], 1, __ATOMIC_ACQ_REL) == 0)
+			return;
 
-		free(end);
+		struct int_run runs[2];
+		runs[0].data = src;
+		runs[0].size = parallel_node_count(shared, level, left);
+		runs[1].data = shared->buffers[level % 2] + shared->offsets[right << level];
+		runs[1].size = parallel_node_count(shared, level, right);
 
-		if (time_diff_nsec > *quantum)
+		struct int_merger merger;
+		if (int_merger_create(&merger, runs, 2) != 0)
 		{
-			*time_taken += time_diff_nsec;
-			coro_yield();
-			clock_gettime(CLOCK_MONOTONIC, start);
+			printf("Error: out of memory\n");
+			__atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+			return;
 		}
+		int_merger_next(&merger, dst, runs[0].size + runs[1].size);
+		int_merger_destroy(&merger);
 	}
 }
 
-// Sorting a single file
+/**
+ * A function that runs a worker of the parallel mode: takes files
+ * from the shared counter, sorts them into their slots and merges
+ */
+static void*
+parallel_worker_func(void* arg)
+{
+	struct parallelWorker* worker = arg;
+	struct parallelShared* shared = worker->shared;
+	int i;
+
+	// A scheduler of its own, so the coroutine calls inside the
+	// sort are no-ops
+	coro_sched_init();
+
+	while ((i = __atomic_fetch_add(&shared->next_file, 1, __ATOMIC_RELAXED)) < shared->num_files)
+	{
+		struct sort_prof_file* prof = &shared->prof_files[i];
+		int num_items;
+		int is_sorted;
+		int* slot = shared->buffers[0] + shared->offsets[i];
+
+		// The file has grown since its size was taken
+		if (read_numbers_to(worker->inputs[i].path, slot, shared->offsets[i + 1] - shared->offsets[i],
+			&num_items, &is_sorted, prof) == NULL)
+		{
+			printf("Error: file %s has changed\n", worker->inputs[i].path);
+			__atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		struct sort_prof_mark mark;
+		sort_prof_mark(&mark);
+
+		if (!is_sorted && int_sort(slot, num_items, INT_SORT_AUTO) != 0)
+		{
+			printf("Error: out of memory\n");
+			__atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		sort_prof_add(&prof->phases[SORT_PHASE_SORT], &mark);
+
+		write_file(worker->inputs[i].path, slot, num_items, shared->format);
+		sort_prof_add(&prof->phases[SORT_PHASE_WRITE], &mark);
+
+		shared->counts[i] = num_items;
+		parallel_merge_up(shared, i);
+	}
+
+	coro_sched_destroy();
+	return NULL;
+}
 
 /**
- * A function that takes a file name quantum, and a time accumulator
- * opens the file and sorts its content writes 
- * the result back to the file, and to a sortedArray struct given as a parameter
+ * A function that sorts the files with num_workers threads, or
+ * processes if use_processes is set, instead of coroutines. The
+ * numbers go into a shared mapping, without copying them through
+ * pipes, and the result is written to the output file
  */
 static void
-sort_file (char* file_name, long quantum, struct sortedArray* file_sort_res, long* time_taken_nsec)
+parallel_sort(struct inputFile* inputs, int num_files, int num_workers, int use_processes,
+	char* output, enum outputFormat format, struct sort_prof* prof)
 {
-	struct timespec *start = malloc(sizeof(*start));
-	clock_gettime(CLOCK_MONOTONIC, start);
+	// A number takes 2 bytes at least in text, with a separator. A
+	// binary run has its count in the header
+	size_t* offsets = malloc((num_files + 1) * sizeof(size_t));
+	if (offsets == NULL)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+	offsets[0] = 0;
+	for (int i = 0; i < num_files; i++)
+	{
+		long long count = binary_run_count(inputs[i].path);
+		offsets[i + 1] = offsets[i] + (count >= 0 ? (size_t)count : (size_t)(inputs[i].size + 1) / 2);
+	}
 
-	long num_bytes = get_file_num_bytes(file_name);
+	int height = 0;
+	while ((1 << height) < num_files)
+		height++;
 
-	char* file_string = (char*) calloc(num_bytes, sizeof(char));
+	size_t meta_size = sizeof(struct parallelShared) + num_files * sizeof(struct sort_prof_file) +
+		num_files * sizeof(int) +
+		(num_files + 1) * sizeof(size_t) + (2 * num_files + height + 1) * sizeof(int);
+	meta_size = (meta_size + 4095) & ~(size_t)4095;
+	size_t buffer_size = (offsets[num_files] + 1) * sizeof(int);
+	size_t map_size = meta_size + 2 * buffer_size;
 
-	read_file(file_string, file_name, num_bytes);
+	// The pages are not touched until they are needed, so only the
+	// real size of the numbers is used, not the upper bound
+	char* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-	int num_items = get_string_num_count(file_string);
+	if (map == MAP_FAILED)
+	{
+		printf("Error: could not map %zu bytes\n", map_size);
+		exit(1);
+	}
+
+	struct parallelShared* shared = (struct parallelShared*)map;
+	char* pos = map + sizeof(*shared);
+	shared->num_files = num_files;
+	shared->format = format;
+	shared->height = height;
+	shared->prof_files = (struct sort_prof_file*)pos;
+	pos += num_files * sizeof(struct sort_prof_file);
+	shared->offsets = (size_t*)pos;
+	memcpy(shared->offsets, offsets, (num_files + 1) * sizeof(size_t));
+	pos += (num_files + 1) * sizeof(size_t);
+	shared->counts = (int*)pos;
+	pos += num_files * sizeof(int);
+	for (int level = 1; level <= height; level++)
+	{
+		shared->node_done[level] = (int*)pos;
+		pos += ((num_files >> level) + 1) * sizeof(int);
+	}
+	shared->buffers[0] = (int*)(map + meta_size);
+	shared->buffers[1] = (int*)(map + meta_size + buffer_size);
+	free(offsets);
 
-	int* numbers = (int*) malloc(num_items * sizeof(int));
+	struct parallelWorker* workers = calloc(num_workers, sizeof(*workers));
+	if (workers == NULL)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
 
-	parse_string_into_array(numbers, file_string);
+	// Nothing buffered should be printed twice by the children
+	fflush(stdout);
 
-	free(file_string);
+	for (int i = 0; i < num_workers; i++)
+	{
+		workers[i].shared = shared;
+		workers[i].inputs = inputs;
 
-	merge_sort(numbers, 0, num_items, &quantum, start, time_taken_nsec);
+		if (!use_processes)
+		{
+			if (pthread_create(&workers[i].thread, NULL, parallel_worker_func, &workers[i]) != 0)
+			{
+				printf("Error: could not start %d threads\n", num_workers);
+				exit(1);
+			}
+			continue;
+		}
 
-	write_file(file_name, numbers, num_items);
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			printf("Error: could not start %d processes\n", num_workers);
+			exit(1);
+		}
+		if (pid == 0)
+		{
+			parallel_worker_func(&workers[i]);
+			fflush(stdout);
+			_exit(shared->failed);
+		}
+	}
 
-	file_sort_res->arr = numbers;
-	file_sort_res->length = num_items;
-	
-	// Adding the last bit of time taken in 
-	//case coroutine didn't yield after its last iteration
-	struct timespec *end = malloc(sizeof(*end));
-	clock_gettime(CLOCK_MONOTONIC, end);
-	*time_taken_nsec += get_time_diff_nsec(end, start);
-
-	free(start);
-	free(end);
+	int failed = 0;
+	for (int i = 0; i < num_workers; i++)
+	{
+		if (!use_processes)
+		{
+			pthread_join(workers[i].thread, NULL);
+			continue;
+		}
+
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+
+	if (failed || shared->failed)
+	{
+		printf("Error: parallel sort has failed\n");
+		exit(1);
+	}
+
+	// The paths of the profile are kept, only the numbers are taken
+	for (int i = 0; i < num_files; i++)
+	{
+		prof->files[i].count = shared->prof_files[i].count;
+		memcpy(prof->files[i].phases, shared->prof_files[i].phases, sizeof(prof->files[i].phases));
+	}
+
+	struct sort_prof_mark mark;
+	sort_prof_mark(&mark);
+
+	size_t total = parallel_node_count(shared, height, 0);
+	write_file(output, shared->buffers[height % 2], total, format);
+	sort_prof_add(&prof->merge, &mark);
+
+	free(workers);
+	munmap(map, map_size);
 }
 
 /**
@@ -365,37 +1120,50 @@ coroutine_func(void *context)
 	struct coro *this = coro_this();
 	struct my_context *ctx = context;
 	char* name = ctx->name;
-	long quantum = ctx ->quantum;
 	struct sortedArray* all_sorted = ctx->all_sorted;
-	int total_num_files = ctx->total_num_files;
-	int* num_remaining_files = ctx->num_remaining_files;
-	long time_taken_nsec = 0;
-	char* file_name = malloc(100 * sizeof(char));
+	void* item;
+	int file_count = 0;
 
 	printf("%s: starting\n", name);
+	coro_set_quantum(this, ctx->quantum);
 
-	while(true){
-		for (int i = 0; i < total_num_files; i++)
+	// Take files from the queue until it is drained
+	while (coro_chan_recv(ctx->files, &item) == 0)
+	{
+		int i = (int)(intptr_t)item;
+		char* file_name = ctx->inputs[i].path;
+		printf("%s: working on file %s\n", name, file_name);
+
+		struct sort_prof_file* prof = &ctx->prof->files[i];
+		prof->path = strdup(file_name);
+		prof->coro = strdup(name);
+		if (prof->path == NULL || prof->coro == NULL)
 		{
-			if (!all_sorted[i].sorted)
-			{
-				all_sorted[i].sorted = true;
-				(*num_remaining_files)--;
-				sprintf(file_name, "test%d.txt", i + 1);
-				printf("%s: working on file %s\n", name, file_name);
-				sort_file(file_name, quantum, &all_sorted[i], &time_taken_nsec);
-			}
+			printf("Error: out of memory\n");
+			exit(1);
 		}
+		file_count++;
 
-		if(*num_remaining_files <=0) 
-			break;	
+		if (ctx->mem_budget > 0)
+			sort_file_external(file_name, ctx, prof);
+		else
+			sort_file(file_name, &all_sorted[i], ctx->format, prof);
 	}
 
 	printf("%s: switch count %lld\n", name, coro_switch_count(this));
-	printf("%s: total working time (in seconds) %lf\n",name, time_taken_nsec / 1e9);
+	printf("%s: total working time (in seconds) %lf\n",name, coro_work_time(this) / 1e9);
+
+	struct timespec end_time;
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	struct sort_prof_coro* prof = &ctx->prof->coros[ctx->index];
+	if (sort_prof_coro_set(prof, name, this, get_time_diff_nsec(&end_time, &ctx->start_time)) != 0)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+	prof->file_count = file_count;
 
 	my_context_delete(ctx);
-	free(file_name);
 	return 0;
 }
 
@@ -406,75 +1174,270 @@ main(int argc, char **argv)
 	clock_gettime(CLOCK_MONOTONIC, start_time);
 	coro_sched_init();
 
-	// Parse args
+	// Parse args: Latency, No. coroutines, [No. threads], [inputs...].
+	// The inputs are files, directories or glob patterns, test*.txt in
+	// the current directory by default. A third number is the thread
+	// count, a file named as a number should be given as ./NUMBER.
+	// --output PATH and --mem-limit SIZE (or with '=') can be anywhere.
+	// --profile prints the times of the phases and coroutines as a
+	// table, --profile-json PATH writes them as JSON ('-' for stdout).
+	// --parallel N sorts with N threads instead of coroutines, or with
+	// N processes with --processes. Latency and coroutines are unused
+	// there. --format text|bin|delta is the format of the sorted files
+	// and the output, the inputs can be in any of them.
+	// --export-text IN OUT converts a file of any format to text
 	int latency = 0;
 	int num_coroutines = 0;
+	int num_threads = 1;
+	size_t mem_limit = 0;
+	char* mem_limit_str = NULL;
+	char* output = "sum.txt";
+	int profile_table = 0;
+	char* profile_json = NULL;
+	int num_parallel = 0;
+	int use_processes = 0;
+	char* format_str = "text";
+	enum outputFormat format = FORMAT_TEXT;
+	char* export_in = NULL;
+	char* export_out = NULL;
+	int num_args = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--mem-limit=", 12) == 0)
+			mem_limit_str = argv[i] + 12;
+		else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc)
+			mem_limit_str = argv[++i];
+		else if (strncmp(argv[i], "--output=", 9) == 0)
+			output = argv[i] + 9;
+		else if ((strcmp(argv[i], "--output") == 0 || strcmp(argv[i], "-o") == 0) && i + 1 < argc)
+			output = argv[++i];
+		else if (strcmp(argv[i], "--profile") == 0)
+			profile_table = 1;
+		else if (strncmp(argv[i], "--profile-json=", 15) == 0)
+			profile_json = argv[i] + 15;
+		else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc)
+			profile_json = argv[++i];
+		else if (strncmp(argv[i], "--parallel=", 11) == 0)
+			num_parallel = atoi(argv[i] + 11);
+		else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc)
+			num_parallel = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--processes") == 0)
+			use_processes = 1;
+		else if (strncmp(argv[i], "--format=", 9) == 0)
+			format_str = argv[i] + 9;
+		else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+			format_str = argv[++i];
+		else if (strcmp(argv[i], "--export-text") == 0 && i + 2 < argc)
+		{
+			export_in = argv[++i];
+			export_out = argv[++i];
+		}
+		else
+			argv[num_args++] = argv[i];
+	}
+	argc = num_args;
 
-	if (argc > 3)
+	if (export_in != NULL)
 	{
-		printf("Error: Too many arguments were provided");
+		export_text(export_in, export_out);
+		free(start_time);
+		return 0;
+	}
+
+	if (strcmp(format_str, "text") == 0)
+		format = FORMAT_TEXT;
+	else if (strcmp(format_str, "bin") == 0)
+		format = FORMAT_BIN;
+	else if (strcmp(format_str, "delta") == 0)
+		format = FORMAT_DELTA;
+	else
+	{
+		printf("Error: unknown format %s, expected text, bin or delta\n", format_str);
+		exit(1);
+	}
+
+	if (format != FORMAT_TEXT && mem_limit_str != NULL)
+	{
+		printf("Error: --mem-limit writes text only\n");
 		exit(1);
 	}
-	else if (argc == 3)
+
+	if (mem_limit_str != NULL)
+	{
+		mem_limit = parse_mem_size(mem_limit_str);
+		if (mem_limit < MEM_LIMIT_RESERVE + EXT_SORT_BUDGET_MIN)
+		{
+			printf("Error: invalid memory limit %s, expected at least %dM\n", mem_limit_str,
+				(MEM_LIMIT_RESERVE + EXT_SORT_BUDGET_MIN) >> 20);
+			exit(1);
+		}
+	}
+
+	if (num_parallel < 0 || (num_parallel > 0 && mem_limit > 0) || (use_processes && num_parallel == 0))
 	{
-		latency = atoi(argv[1]);
-		num_coroutines = atoi(argv[2]);
+		printf("Error: --parallel expects a number of workers, and can't be used with --mem-limit\n");
+		exit(1);
 	}
-	else {
-		printf("Error: Insufficient arguments were provided. Expected (Latency, No. coroutines)");
+
+	if (argc < 3 || !is_number(argv[1]) || !is_number(argv[2]))
+	{
+		printf("Error: Insufficient arguments were provided. Expected (Latency, No. coroutines, [No. threads], [inputs...])\n");
 		exit(1);
 	}
 
-	int num_test_files = count_test_files();
-	int remaining_files = num_test_files;
+	latency = atoi(argv[1]);
+	num_coroutines = atoi(argv[2]);
+	int first_input = 3;
+	if (argc > 3 && is_number(argv[3]))
+		num_threads = atoi(argv[first_input++]);
+
+	// Collect the input files, except the output one
+	struct stat output_stat;
+	struct stat* output_st = stat(output, &output_stat) == 0 ? &output_stat : NULL;
+	struct fileList inputs = {NULL, 0, 0};
+
+	if (first_input < argc)
+	{
+		for (int i = first_input; i < argc; i++)
+			add_input_arg(&inputs, argv[i], output_st);
+	}
+	else
+	{
+		glob_t matches;
+		if (glob("test*.txt", 0, NULL, &matches) == 0)
+		{
+			for (size_t i = 0; i < matches.gl_pathc; i++)
+				add_input_arg(&inputs, matches.gl_pathv[i], output_st);
+			globfree(&matches);
+		}
+	}
+	sort_input_files(&inputs);
+
+	// Nobody would sort the files without coroutines
+	if (num_coroutines < 1 && num_parallel == 0 && inputs.count > 0)
+	{
+		printf("Error: at least one coroutine is needed to sort the files\n");
+		exit(1);
+	}
+
+	// More than one thread - run the coroutines on worker threads
+	if (num_threads > 1 && num_parallel == 0 && coro_sched_start_workers(num_threads) != 0)
+	{
+		printf("Error: could not start %d threads\n", num_threads);
+		exit(1);
+	}
+
+	int num_test_files = inputs.count;
 	struct sortedArray* all_sorted = malloc(num_test_files * sizeof(*all_sorted));
-	long total_num_items = 0;
+	if (all_sorted == NULL && num_test_files > 0)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+
+	// Fill the work queue. It is closed right away, so the workers
+	// exit when it is empty
+	struct coro_chan* files = coro_chan_new(num_test_files > 0 ? num_test_files : 1);
+	if (files == NULL)
+	{
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < num_test_files; i++)
+		coro_chan_send(files, (void*)(intptr_t)i);
+	coro_chan_close(files);
 
 	// Covnert to nanoseconds
-	long quantum = ((float)latency / num_test_files) * 1e3;
+	long quantum = num_test_files > 0 ? ((float)latency / num_test_files) * 1e3 : 0;
+
+	// With a memory limit, each coroutine sorts its files externally
+	// within an equal share of it
+	size_t mem_budget = 0;
+	struct ext_run_list all_runs;
+	struct coro_mutex all_runs_lock;
+	ext_run_list_create(&all_runs);
+	coro_mutex_create(&all_runs_lock);
+
+	if (mem_limit > 0 && num_coroutines > 0)
+	{
+		mem_budget = (mem_limit - MEM_LIMIT_RESERVE) / num_coroutines;
+		if (mem_budget < EXT_SORT_BUDGET_MIN)
+		{
+			printf("Error: memory limit is too small for %d coroutines\n", num_coroutines);
+			exit(1);
+		}
+	}
 	
-	// Start coroutines
-	for (int i = 0; i < num_coroutines; ++i) 
+	struct sort_prof prof;
+	if (sort_prof_create(&prof, num_test_files, num_parallel > 0 ? 0 : num_coroutines) != 0)
 	{
-		char name[16];
-		sprintf(name, "coro_%d", i);
-		coro_new(coroutine_func, my_context_new(name, i,&quantum, all_sorted, &remaining_files, num_test_files));
+		printf("Error: out of memory\n");
+		exit(1);
 	}
 
-	// End coroutines
-	struct coro *c;
-	while ((c = coro_sched_wait()) != NULL) {
-		printf("Finished %d\n", coro_status(c));
-		coro_delete(c);
+	// Parallel mode - threads or processes sort the files and write the
+	// result, no coroutines are started
+	if (num_parallel > 0)
+	{
+		for (int i = 0; i < num_test_files; i++)
+		{
+			prof.files[i].path = strdup(inputs.files[i].path);
+			if (prof.files[i].path == NULL)
+			{
+				printf("Error: out of memory\n");
+				exit(1);
+			}
+		}
+		parallel_sort(inputs.files, num_test_files, num_parallel, use_processes, output, format, &prof);
+		num_coroutines = 0;
 	}
-	
-	// Accumulate sort results 
-	for (int i = 0; i < num_test_files; ++i) 
+
+	// Start coroutines
+	struct coro_group *group = coro_group_new();
+	for (int i = 0; i < num_coroutines; ++i) 
 	{
-		total_num_items += all_sorted[i].length;
+		// Enough for "coro_" and any int
+		char name[32];
+		snprintf(name, sizeof(name), "coro_%d", i);
+		coro_group_spawn(group, coroutine_func, my_context_new(name, i, &quantum, all_sorted, inputs.files,
+			files, format, mem_budget, &all_runs, &all_runs_lock, &prof), NULL);
 	}
 
-	struct sortedArray accumulator = {
-		malloc(total_num_items * sizeof(int)), 0, 0
-	};
+	// End coroutines, each one is freed as soon as it finishes
+	int status = coro_group_join(group);
+	coro_group_delete(group);
+	if (status != 0)
+	{
+		printf("Error: a coroutine has failed with %d\n", status);
+		exit(1);
+	}
+	coro_chan_delete(files);
+	
+	// Merge sort results and write them to file
+	struct sort_prof_mark merge_mark;
+	sort_prof_mark(&merge_mark);
 
-	// Merge sort results
-	for (int i = 0; i < num_test_files; i ++)
+	if (mem_budget > 0)
 	{
-		
-		append_array(accumulator.arr, accumulator.length, all_sorted[i].arr, all_sorted[i].length);
+		int fd = coro_open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-		if (i)
-		{	int m = accumulator.length - 1;
-			int r = m + all_sorted[i].length;
-			merge_and_sort(accumulator.arr, 0, m, r);
+		if (fd < 0 || ext_merge_text(&all_runs, mem_limit - MEM_LIMIT_RESERVE, fd) != 0)
+		{
+			printf("Error: could not write file %s: %s\n", output, strerror(errno));
+			exit(1);
 		}
 
-		accumulator.length += all_sorted[i].length;
+		printf("Success: wrote to file %s\n", output);
+		close(fd);
 	}
-
-	// Write results to file
-	write_file("sum.txt", accumulator.arr, accumulator.length);
+	else if (num_parallel == 0)
+	{
+		write_merged_file(output, all_sorted, num_test_files, format);
+	}
+	sort_prof_add(&prof.merge, &merge_mark);
+	ext_run_list_destroy(&all_runs);
+	coro_mutex_destroy(&all_runs_lock);
 
 	// Calculate total time and free memory
 	struct timespec *end_time = malloc(sizeof(*end_time));
@@ -482,12 +1445,35 @@ main(int argc, char **argv)
 
 	printf("Total program working time (in seconds) %lf\n", get_time_diff_nsec(end_time, start_time) / 1e9);
 
-	for (int i = 0; i < num_test_files; i ++)
+	prof.total_nsec = get_time_diff_nsec(end_time, start_time);
+	if (profile_table)
+		sort_prof_print_table(&prof, stdout);
+	if (profile_json != NULL)
+	{
+		FILE* json = strcmp(profile_json, "-") == 0 ? stdout : fopen(profile_json, "w");
+		if (json == NULL)
+		{
+			printf("Error: could not open file %s\n", profile_json);
+			exit(1);
+		}
+		sort_prof_print_json(&prof, json);
+		if (json != stdout)
+			fclose(json);
+	}
+	sort_prof_destroy(&prof);
+
+	for (int i = 0; i < num_test_files && mem_budget == 0 && num_parallel == 0; i ++)
 	{
 		free(all_sorted[i].arr);
 	}
 	free(all_sorted);
-	free(accumulator.arr);
+	for (int i = 0; i < inputs.count; i ++)
+	{
+		free(inputs.files[i].path);
+	}
+	free(inputs.files);
+	coro_io_destroy();
+	coro_sched_destroy();
 	free(start_time);
 	free(end_time);
 
@@ -0,0 +1,479 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "libcoro.h"
+#include "int_scan.h"
+#include "int_print.h"
+#include "int_sort.h"
+
+/**
+ * Benchmark of the whole sort pipeline. Seeded datasets of several
+ * distributions are generated into a temporary directory, and the
+ * sorter is run on them for each pair of coroutine count and
+ * latency from the given lists, several times. Each run is
+ * checked: all the files and the output are sorted and have the
+ * same multiset of numbers as generated. Run 'make bench_sort', or
+ * './bench_sort --help' for the options.
+ */
+
+enum bench_dist {
+	BENCH_DIST_UNIFORM,
+	BENCH_DIST_SORTED,
+	BENCH_DIST_REVERSE,
+	/** Only BENCH_FEW_UNIQUE different values. */
+	BENCH_DIST_FEW,
+	/** Zipf with exponent 1 over BENCH_ZIPF_RANKS values. */
+	BENCH_DIST_ZIPF,
+	bench_dist_MAX,
+};
+
+static const char *bench_dist_strs[] = {
+	"uniform", "sorted", "reverse", "few", "zipf",
+};
+
+enum {
+	BENCH_FEW_UNIQUE = 16,
+	BENCH_ZIPF_RANKS = 64 * 1024,
+	BENCH_LIST_MAX = 32,
+	BENCH_READ_CHUNK = 1024 * 1024,
+};
+
+struct bench_list {
+	int values[BENCH_LIST_MAX];
+	int count;
+};
+
+/** Multiset checksum: independent of the order of the numbers. */
+struct bench_sum {
+	uint64_t count;
+	uint64_t hash;
+};
+
+struct bench_opts {
+	const char *sorter;
+	const char *dir;
+	bool dists[bench_dist_MAX];
+	int size;
+	int files;
+	struct bench_list coros;
+	struct bench_list latencies;
+	int repeat;
+	uint64_t seed;
+};
+
+static long long
+bench_now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t
+bench_mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/** splitmix64. */
+static uint64_t
+bench_rand(uint64_t *state)
+{
+	*state += 0x9e3779b97f4a7c15ULL;
+	return bench_mix(*state);
+}
+
+static void
+bench_sum_add(struct bench_sum *s, const int *values, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		s->hash += bench_mix((uint32_t)values[i]);
+	s->count += count;
+}
+
+/** Cumulative distribution of the Zipf ranks. */
+static double *
+bench_zipf_cdf(void)
+{
+	double *cdf = malloc(BENCH_ZIPF_RANKS * sizeof(cdf[0]));
+	double total = 0;
+	for (int i = 0; i < BENCH_ZIPF_RANKS; ++i) {
+		total += 1.0 / (i + 1);
+		cdf[i] = total;
+	}
+	for (int i = 0; i < BENCH_ZIPF_RANKS; ++i)
+		cdf[i] /= total;
+	return cdf;
+}
+
+static int
+bench_zipf_rank(const double *cdf, double u)
+{
+	int lo = 0, hi = BENCH_ZIPF_RANKS - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+bench_generate(int *values, int size, enum bench_dist dist, uint64_t seed,
+	       const double *zipf_cdf)
+{
+	uint64_t state = seed;
+	for (int i = 0; i < size; ++i) {
+		uint64_t r = bench_rand(&state);
+		switch (dist) {
+		case BENCH_DIST_FEW:
+			values[i] = (int)bench_mix(seed + r % BENCH_FEW_UNIQUE);
+			break;
+		case BENCH_DIST_ZIPF: {
+			double u = (r >> 11) * 0x1.0p-53;
+			int rank = bench_zipf_rank(zipf_cdf, u);
+			/* Scatter the frequent values over the range. */
+			values[i] = (int)bench_mix(seed + rank);
+			break;
+		}
+		default:
+			values[i] = (int)r;
+			break;
+		}
+	}
+	if (dist == BENCH_DIST_SORTED || dist == BENCH_DIST_REVERSE)
+		int_sort(values, size, INT_SORT_AUTO);
+	if (dist == BENCH_DIST_REVERSE) {
+		for (int i = 0, j = size - 1; i < j; ++i, --j) {
+			int v = values[i];
+			values[i] = values[j];
+			values[j] = v;
+		}
+	}
+}
+
+static int
+bench_write_file(const char *path, const int *values, int size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	struct int_printer p;
+	int_printer_create(&p, fd);
+	int_printer_put(&p, values, size);
+	int rc = int_printer_destroy(&p);
+	close(fd);
+	return rc;
+}
+
+/**
+ * Check, that the file is sorted and has the expected multiset of
+ * numbers. Print the reason, if not.
+ */
+static bool
+bench_check_file(const char *path, const struct bench_sum *expected)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: could not open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	struct int_scanner s;
+	int_scanner_create(&s);
+	char *buf = malloc(BENCH_READ_CHUNK);
+	ssize_t rc;
+	while ((rc = read(fd, buf, BENCH_READ_CHUNK)) > 0)
+		int_scanner_feed(&s, buf, rc);
+	free(buf);
+	close(fd);
+	size_t count;
+	int *values = int_scanner_finish(&s, &count);
+	bool ok = rc == 0;
+	for (size_t i = 1; i < count && ok; ++i) {
+		if (values[i - 1] > values[i]) {
+			printf("Error: %s is not sorted at %zu\n", path, i);
+			ok = false;
+		}
+	}
+	struct bench_sum sum = {0, 0};
+	bench_sum_add(&sum, values, count);
+	if (ok && (sum.count != expected->count ||
+		   sum.hash != expected->hash)) {
+		printf("Error: %s has other numbers than the input, "
+		       "%llu instead of %llu\n", path,
+		       (unsigned long long)sum.count,
+		       (unsigned long long)expected->count);
+		ok = false;
+	}
+	free(values);
+	return ok;
+}
+
+/** Run the sorter with its output muted. Return its wall time. */
+static long long
+bench_run_sorter(const struct bench_opts *o, int coros, int latency,
+		 char **paths, const char *output)
+{
+	char coros_str[16], latency_str[16];
+	snprintf(coros_str, sizeof(coros_str), "%d", coros);
+	snprintf(latency_str, sizeof(latency_str), "%d", latency);
+	char **argv = calloc(o->files + 6, sizeof(argv[0]));
+	int argc = 0;
+	argv[argc++] = (char *)o->sorter;
+	argv[argc++] = latency_str;
+	argv[argc++] = coros_str;
+	for (int i = 0; i < o->files; ++i)
+		argv[argc++] = paths[i];
+	argv[argc++] = "--output";
+	argv[argc++] = (char *)output;
+	argv[argc] = NULL;
+
+	long long start = bench_now_nsec();
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		execv(o->sorter, argv);
+		fprintf(stderr, "Error: could not run %s: %s\n", o->sorter,
+			strerror(errno));
+		_exit(127);
+	}
+	int status = -1;
+	if (pid > 0)
+		waitpid(pid, &status, 0);
+	long long nsec = bench_now_nsec() - start;
+	free(argv);
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("Error: %s failed\n", o->sorter);
+		return -1;
+	}
+	return nsec;
+}
+
+static int
+bench_cmp_times(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Run the whole matrix on one dataset. Return false on error. */
+static bool
+bench_dist(const struct bench_opts *o, enum bench_dist dist,
+	   const double *zipf_cdf)
+{
+	int **values = calloc(o->files, sizeof(values[0]));
+	char **paths = calloc(o->files, sizeof(paths[0]));
+	struct bench_sum *sums = calloc(o->files, sizeof(sums[0]));
+	struct bench_sum total = {0, 0};
+	for (int i = 0; i < o->files; ++i) {
+		values[i] = malloc(o->size * sizeof(values[i][0]));
+		bench_generate(values[i], o->size, dist,
+			       bench_mix(o->seed + dist * 1000003 + i), zipf_cdf);
+		bench_sum_add(&sums[i], values[i], o->size);
+		bench_sum_add(&total, values[i], o->size);
+		size_t len = strlen(o->dir) + 32;
+		paths[i] = malloc(len);
+		snprintf(paths[i], len, "%s/test%d.txt", o->dir, i + 1);
+	}
+	char *output = malloc(strlen(o->dir) + 16);
+	sprintf(output, "%s/sum.txt", o->dir);
+	long long *times = malloc(o->repeat * sizeof(times[0]));
+	bool ok = true;
+
+	for (int c = 0; c < o->coros.count && ok; ++c) {
+		for (int l = 0; l < o->latencies.count && ok; ++l) {
+			for (int r = 0; r < o->repeat && ok; ++r) {
+				/* The sorter sorts the files in place. */
+				for (int i = 0; i < o->files && ok; ++i) {
+					ok = bench_write_file(paths[i], values[i],
+							      o->size) == 0;
+				}
+				if (! ok) {
+					printf("Error: could not write the "
+					       "dataset: %s\n", strerror(errno));
+					break;
+				}
+				times[r] = bench_run_sorter(
+					o, o->coros.values[c],
+					o->latencies.values[l], paths, output);
+				ok = times[r] >= 0;
+				for (int i = 0; i < o->files && ok; ++i)
+					ok = bench_check_file(paths[i], &sums[i]);
+				ok = ok && bench_check_file(output, &total);
+			}
+			if (! ok)
+				break;
+			qsort(times, o->repeat, sizeof(times[0]),
+			      bench_cmp_times);
+			printf("%-8s %6d %8d %10.2lf %10.2lf %10.2lf  ok\n",
+			       bench_dist_strs[dist], o->coros.values[c],
+			       o->latencies.values[l], times[0] / 1e6,
+			       times[o->repeat / 2] / 1e6,
+			       times[o->repeat - 1] / 1e6);
+			fflush(stdout);
+		}
+	}
+
+	for (int i = 0; i < o->files; ++i) {
+		unlink(paths[i]);
+		free(paths[i]);
+		free(values[i]);
+	}
+	unlink(output);
+	free(output);
+	free(times);
+	free(sums);
+	free(paths);
+	free(values);
+	return ok;
+}
+
+/** Parse a comma separated list of positive numbers. */
+static int
+bench_parse_list(struct bench_list *l, const char *str)
+{
+	l->count = 0;
+	while (*str != 0) {
+		char *end;
+		long v = strtol(str, &end, 10);
+		if (end == str || v <= 0 || l->count == BENCH_LIST_MAX)
+			return -1;
+		l->values[l->count++] = v;
+		if (*end == ',')
+			++end;
+		else if (*end != 0)
+			return -1;
+		str = end;
+	}
+	return l->count > 0 ? 0 : -1;
+}
+
+static int
+bench_parse_dists(bool *dists, const char *str)
+{
+	memset(dists, 0, bench_dist_MAX * sizeof(dists[0]));
+	char *copy = strdup(str);
+	int rc = 0;
+	for (char *name = strtok(copy, ","); name != NULL;
+	     name = strtok(NULL, ",")) {
+		int d = 0;
+		while (d < bench_dist_MAX && strcmp(bench_dist_strs[d], name) != 0)
+			++d;
+		if (d == bench_dist_MAX)
+			rc = -1;
+		else
+			dists[d] = true;
+	}
+	free(copy);
+	return rc;
+}
+
+static void
+bench_usage(void)
+{
+	printf("Usage: bench_sort [options]\n"
+	       "  --sorter PATH     sorter to run, ./a.out\n"
+	       "  --dir PATH        directory for the datasets, a new one "
+	       "in $TMPDIR or /tmp\n"
+	       "  --dist LIST       datasets, any of uniform,sorted,reverse,"
+	       "few,zipf; all\n"
+	       "  --size N          numbers in each file, 40000\n"
+	       "  --files N         file count, 6\n"
+	       "  --coros LIST      coroutine counts, 1,2,4,8\n"
+	       "  --latency LIST    latencies in microseconds, 100,1000,10000\n"
+	       "  --repeat N        runs of each case, 5\n"
+	       "  --seed N          seed of the datasets, 1\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_opts o;
+	memset(&o, 0, sizeof(o));
+	o.sorter = "./a.out";
+	o.size = 40000;
+	o.files = 6;
+	o.repeat = 5;
+	o.seed = 1;
+	bench_parse_dists(o.dists, "uniform,sorted,reverse,few,zipf");
+	bench_parse_list(&o.coros, "1,2,4,8");
+	bench_parse_list(&o.latencies, "100,1000,10000");
+
+	for (int i = 1; i < argc; ++i) {
+		const char *name = argv[i];
+		if (strcmp(name, "--help") == 0) {
+			bench_usage();
+			return 0;
+		}
+		const char *value = i + 1 < argc ? argv[++i] : "";
+		int rc = 0;
+		if (strcmp(name, "--sorter") == 0)
+			o.sorter = value;
+		else if (strcmp(name, "--dir") == 0)
+			o.dir = value;
+		else if (strcmp(name, "--dist") == 0)
+			rc = bench_parse_dists(o.dists, value);
+		else if (strcmp(name, "--size") == 0)
+			rc = (o.size = atoi(value)) > 0 ? 0 : -1;
+		else if (strcmp(name, "--files") == 0)
+			rc = (o.files = atoi(value)) > 0 ? 0 : -1;
+		else if (strcmp(name, "--coros") == 0)
+			rc = bench_parse_list(&o.coros, value);
+		else if (strcmp(name, "--latency") == 0)
+			rc = bench_parse_list(&o.latencies, value);
+		else if (strcmp(name, "--repeat") == 0)
+			rc = (o.repeat = atoi(value)) > 0 ? 0 : -1;
+		else if (strcmp(name, "--seed") == 0)
+			o.seed = strtoull(value, NULL, 10);
+		else
+			rc = -1;
+		if (rc != 0) {
+			printf("Error: invalid option %s\n", name);
+			bench_usage();
+			return 1;
+		}
+	}
+
+	char tmp_dir[256];
+	bool is_tmp_dir = o.dir == NULL;
+	if (is_tmp_dir) {
+		const char *tmp = getenv("TMPDIR");
+		snprintf(tmp_dir, sizeof(tmp_dir), "%s/sort_bench_XXXXXX",
+			 tmp != NULL && *tmp != 0 ? tmp : "/tmp");
+		if (mkdtemp(tmp_dir) == NULL) {
+			printf("Error: could not create %s\n", tmp_dir);
+			return 1;
+		}
+		o.dir = tmp_dir;
+	}
+
+	coro_sched_init();
+	double *zipf_cdf = bench_zipf_cdf();
+	printf("%d files x %d numbers, %d runs each, times in ms\n",
+	       o.files, o.size, o.repeat);
+	printf("%-8s %6s %8s %10s %10s %10s  check\n", "dataset", "coros",
+	       "latency", "min", "median", "max");
+	bool ok = true;
+	for (int d = 0; d < bench_dist_MAX && ok; ++d) {
+		if (o.dists[d])
+			ok = bench_dist(&o, d, zipf_cdf);
+	}
+	free(zipf_cdf);
+	coro_sched_destroy();
+	if (is_tmp_dir)
+		rmdir(tmp_dir);
+	return ok ? 0 : 1;
+}
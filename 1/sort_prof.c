@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcoro.h"
+#include "sort_prof.h"
+
+const char *sort_phase_strs[] = {
+	"read", "parse", "sort", "write", "merge",
+};
+
+int
+sort_prof_create(struct sort_prof *p, int file_count, int coro_count)
+{
+	memset(p, 0, sizeof(*p));
+	p->file_count = file_count;
+	p->files = calloc(file_count > 0 ? file_count : 1, sizeof(p->files[0]));
+	p->coro_count = coro_count;
+	p->coros = calloc(coro_count > 0 ? coro_count : 1, sizeof(p->coros[0]));
+	if (p->files == NULL || p->coros == NULL) {
+		free(p->files);
+		free(p->coros);
+		memset(p, 0, sizeof(*p));
+		return -1;
+	}
+	return 0;
+}
+
+void
+sort_prof_destroy(struct sort_prof *p)
+{
+	for (int i = 0; i < p->file_count; ++i) {
+		free(p->files[i].path);
+		free(p->files[i].coro);
+	}
+	for (int i = 0; i < p->coro_count; ++i)
+		free(p->coros[i].name);
+	free(p->files);
+	free(p->coros);
+}
+
+static long long
+sort_prof_now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+sort_prof_mark(struct sort_prof_mark *m)
+{
+	m->wall_nsec = sort_prof_now_nsec();
+	m->work_nsec = coro_work_time(coro_this());
+}
+
+void
+sort_prof_add(struct sort_prof_time *t, struct sort_prof_mark *m)
+{
+	struct sort_prof_mark now;
+	sort_prof_mark(&now);
+	t->wall_nsec += now.wall_nsec - m->wall_nsec;
+	t->work_nsec += now.work_nsec - m->work_nsec;
+	*m = now;
+}
+
+int
+sort_prof_coro_set(struct sort_prof_coro *pc, const char *name,
+		   const struct coro *c, long long total_nsec)
+{
+	free(pc->name);
+	pc->name = strdup(name);
+	if (pc->name == NULL)
+		return -1;
+	pc->switch_count = coro_switch_count(c);
+	pc->total_nsec = total_nsec;
+	pc->work_nsec = coro_work_time(c);
+	pc->ready_nsec = coro_ready_time(c);
+	return 0;
+}
+
+/** The rest of the lifetime is spent suspended. */
+static long long
+sort_prof_coro_blocked(const struct sort_prof_coro *pc)
+{
+	long long blocked = pc->total_nsec - pc->work_nsec - pc->ready_nsec;
+	return blocked > 0 ? blocked : 0;
+}
+
+void
+sort_prof_print_table(const struct sort_prof *p, FILE *out)
+{
+	fprintf(out, "\nPhases of the files, ms of work (ms of wall clock)\n");
+	fprintf(out, "%-24s %10s", "file", "numbers");
+	for (int i = 0; i < SORT_PHASE_MERGE; ++i)
+		fprintf(out, " %17s", sort_phase_strs[i]);
+	fprintf(out, "  coroutine\n");
+	for (int i = 0; i < p->file_count; ++i) {
+		const struct sort_prof_file *f = &p->files[i];
+		fprintf(out, "%-24s %10zu", f->path != NULL ? f->path : "-",
+			f->count);
+		for (int j = 0; j < SORT_PHASE_MERGE; ++j) {
+			char cell[32];
+			snprintf(cell, sizeof(cell), "%.2lf (%.2lf)",
+				 f->phases[j].work_nsec / 1e6,
+				 f->phases[j].wall_nsec / 1e6);
+			fprintf(out, " %17s", cell);
+		}
+		fprintf(out, "  %s\n", f->coro != NULL ? f->coro : "-");
+	}
+
+	fprintf(out, "\nCoroutines, ms\n");
+	fprintf(out, "%-12s %6s %10s %10s %10s %10s %10s\n", "coroutine",
+		"files", "switches", "work", "ready", "suspended", "total");
+	for (int i = 0; i < p->coro_count; ++i) {
+		const struct sort_prof_coro *c = &p->coros[i];
+		fprintf(out, "%-12s %6d %10lld %10.2lf %10.2lf %10.2lf %10.2lf\n",
+			c->name != NULL ? c->name : "-", c->file_count,
+			c->switch_count, c->work_nsec / 1e6,
+			c->ready_nsec / 1e6, sort_prof_coro_blocked(c) / 1e6,
+			c->total_nsec / 1e6);
+	}
+	fprintf(out, "\nmerge %.2lf ms (%.2lf ms of wall clock), total %.2lf ms\n",
+		p->merge.work_nsec / 1e6, p->merge.wall_nsec / 1e6,
+		p->total_nsec / 1e6);
+}
+
+static void
+sort_prof_print_str(const char *str, FILE *out)
+{
+	if (str == NULL) {
+		fprintf(out, "null");
+		return;
+	}
+	fputc('"', out);
+	for (const unsigned char *c = (const unsigned char *)str; *c != 0;
+	     ++c) {
+		if (*c == '"' || *c == '\\')
+			fprintf(out, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(out, "\\u%04x", *c);
+		else
+			fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+static void
+sort_prof_print_time(const struct sort_prof_time *t, FILE *out)
+{
+	fprintf(out, "{\"wall_nsec\": %lld, \"work_nsec\": %lld}",
+		t->wall_nsec, t->work_nsec);
+}
+
+void
+sort_prof_print_json(const struct sort_prof *p, FILE *out)
+{
+	fprintf(out, "{\n  \"total_nsec\": %lld,\n  \"merge\": ", p->total_nsec);
+	sort_prof_print_time(&p->merge, out);
+	fprintf(out, ",\n  \"files\": [");
+	for (int i = 0; i < p->file_count; ++i) {
+		const struct sort_prof_file *f = &p->files[i];
+		fprintf(out, "%s\n    {\"path\": ", i > 0 ? "," : "");
+		sort_prof_print_str(f->path, out);
+		fprintf(out, ", \"coroutine\": ");
+		sort_prof_print_str(f->coro, out);
+		fprintf(out, ", \"count\": %zu, \"phases\": {", f->count);
+		for (int j = 0; j < SORT_PHASE_MERGE; ++j) {
+			fprintf(out, "%s\"%s\": ", j > 0 ? ", " : "",
+				sort_phase_strs[j]);
+			sort_prof_print_time(&f->phases[j], out);
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "\n  ],\n  \"coroutines\": [");
+	for (int i = 0; i < p->coro_count; ++i) {
+		const struct sort_prof_coro *c = &p->coros[i];
+		fprintf(out, "%s\n    {\"name\": ", i > 0 ? "," : "");
+		sort_prof_print_str(c->name, out);
+		fprintf(out, ", \"files\": %d, \"switch_count\": %lld, "
+			"\"total_nsec\": %lld, \"work_nsec\": %lld, "
+			"\"ready_nsec\": %lld, \"suspended_nsec\": %lld}",
+			c->file_count, c->switch_count, c->total_nsec,
+			c->work_nsec, c->ready_nsec, sort_prof_coro_blocked(c));
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Profile of a sort run. Each file gets the time of its phases,
+ * each coroutine gets its switch count and how its lifetime was
+ * split between running, waiting for a turn in the scheduler, and
+ * being suspended (on I/O, locks). A phase is measured both by
+ * the wall clock and by the work time of the coroutine, which
+ * does not count the other coroutines running meanwhile.
+ *
+ * The records are preallocated and each one is filled by a single
+ * coroutine, so they need no locking. The report is printed when
+ * all the coroutines are over.
+ */
+
+struct coro;
+
+enum sort_phase {
+	/** Open and read or map the file. */
+	SORT_PHASE_READ,
+	/** Convert the text to numbers. */
+	SORT_PHASE_PARSE,
+	SORT_PHASE_SORT,
+	/** Write the sorted numbers back. */
+	SORT_PHASE_WRITE,
+	/** Merge of the sorted files into the output. */
+	SORT_PHASE_MERGE,
+	sort_phase_MAX,
+};
+
+/** Names of the phases: "read", "parse", ... */
+extern const char *sort_phase_strs[];
+
+struct sort_prof_time {
+	long long wall_nsec;
+	long long work_nsec;
+};
+
+/** Point in time to measure a phase from. */
+struct sort_prof_mark {
+	long long wall_nsec;
+	long long work_nsec;
+};
+
+struct sort_prof_file {
+	char *path;
+	/** Name of the coroutine, which sorted the file. */
+	char *coro;
+	/** Number count. */
+	size_t count;
+	struct sort_prof_time phases[sort_phase_MAX];
+};
+
+struct sort_prof_coro {
+	char *name;
+	int file_count;
+	long long switch_count;
+	/** Lifetime of the coroutine. */
+	long long total_nsec;
+	/** Time running. */
+	long long work_nsec;
+	/** Time ready, but waiting for a turn. */
+	long long ready_nsec;
+};
+
+struct sort_prof {
+	struct sort_prof_file *files;
+	int file_count;
+	struct sort_prof_coro *coros;
+	int coro_count;
+	/** The final merge. */
+	struct sort_prof_time merge;
+	/** Time of the whole program. */
+	long long total_nsec;
+};
+
+/**
+ * Create an empty report for the files and coroutines.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+sort_prof_create(struct sort_prof *p, int file_count, int coro_count);
+
+void
+sort_prof_destroy(struct sort_prof *p);
+
+/** Remember the current time of the current coroutine. */
+void
+sort_prof_mark(struct sort_prof_mark *m);
+
+/**
+ * Add the time since the mark to @a t, and move the mark to now,
+ * so the next phase can be measured from it.
+ */
+void
+sort_prof_add(struct sort_prof_time *t, struct sort_prof_mark *m);
+
+/**
+ * Fill the record of a coroutine from its scheduler statistics.
+ * @a total_nsec is its lifetime. Return -1, if there is no memory
+ * for the name, 0 otherwise.
+ */
+int
+sort_prof_coro_set(struct sort_prof_coro *pc, const char *name,
+		   const struct coro *c, long long total_nsec);
+
+/** Print the report as tables, times in milliseconds. */
+void
+sort_prof_print_table(const struct sort_prof *p, FILE *out);
+
+/** Print the report as JSON, times in nanoseconds. */
+void
+sort_prof_print_json(const struct sort_prof *p, FILE *out);
@@ -0,0 +1,63 @@
+import subprocess
+import argparse
+import time
+
+parser = argparse.ArgumentParser(description='Command launch benchmark '\
+				 'of the shells')
+parser.add_argument('-e', type=str, nargs='+',
+		    default=['./shell_fork', './shell_spawn'],
+		    help='executable shell files to compare')
+parser.add_argument('-n', type=int, default=2000,
+		    help='number of command lines in the script')
+parser.add_argument('-r', type=int, default=3,
+		    help='runs of each shell, the best one is taken')
+args = parser.parse_args()
+
+# Short pipelines, so the time goes to starting the commands and not
+# to their work. Each line has 3 commands
+pipelines = [
+'echo {} | cat | wc -c',
+'true | true | false',
+'printf "a\\nb\\n" | grep b | cat > /dev/null',
+]
+# Trivial commands of loop-heavy scripts, which are builtins. Each line
+# has 1 command
+builtins = [
+'true',
+'echo {}',
+'test {} -gt 0',
+'pwd',
+]
+
+def make_script(lines):
+	script = ''
+	for i in range(args.n):
+		script += lines[i % len(lines)].format(i) + '\n'
+	return (script + 'exit 0\n').encode()
+
+def bench(name, script, command_count):
+	expected = None
+	for shell in args.e:
+		best = None
+		for run in range(args.r):
+			start = time.monotonic()
+			p = subprocess.run([shell], input=script,
+					   stdout=subprocess.PIPE,
+					   stderr=subprocess.STDOUT)
+			took = time.monotonic() - start
+			if p.returncode != 0:
+				print('{}: exit code {}'.format(shell, p.returncode))
+				exit(-1)
+			if expected is None:
+				expected = p.stdout
+			elif p.stdout != expected:
+				print('{}: output differs'.format(shell))
+				exit(-1)
+			if best is None or took < best:
+				best = took
+		print('{}: {}, {} commands in {:.3f} s, {:.0f} commands per '\
+		      'second'.format(shell, name, command_count, best,
+				      command_count / best))
+
+bench('pipelines', make_script(pipelines), args.n * 3)
+bench('builtins', make_script(builtins), args.n)
@@ -1,12 +1,45 @@
 #include "parser.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+extern char **environ;
+
+/*
+ * An argv array reused by all the commands, so launching a command
+ * allocates nothing once it has grown to the longest command
+ */
+struct argv_buf {
+  char **data;
+  uint32_t capacity;
+};
+
+/*
+ * A function that fills the argv array of a command, growing it
+ * if needed
+ */
+static char **argv_buf_fill(struct argv_buf *buf, const struct command *cmd) {
+  if (cmd->arg_count + 2 > buf->capacity) {
+    buf->capacity = cmd->arg_count + 2;
+    buf->data = realloc(buf->data, buf->capacity * sizeof(*buf->data));
+    assert(buf->data != NULL);
+  }
+
+  buf->data[0] = cmd->exe;
+  for (uint32_t i = 0; i < cmd->arg_count; ++i)
+    buf->data[i + 1] = cmd->args[i];
+  buf->data[cmd->arg_count + 1] = NULL;
+  return buf->data;
+}
+
 /*
  * A function that returns the number of pipes in a command line
  */
@@ -66,74 +99,699 @@ static void delete_pipes(int num_pipes, int *redirect_fd, int (*pd)[2]) {
     close(*redirect_fd);
 }
 
+/*
+ * A cached executable - a command name and its absolute path found
+ * in PATH
+ */
+struct path_entry {
+  char *name;
+  char *path;
+  uint32_t hash;
+  struct path_entry *next;
+};
+
+/*
+ * A hash table of executables, like the "hash" of other shells. A
+ * repeated command costs one probe instead of trying every PATH
+ * directory. It is dropped when PATH changes, and an entry is dropped
+ * when its file is gone
+ */
+struct path_cache {
+  struct path_entry **buckets;
+  uint32_t bucket_count;
+  uint32_t count;
+  // PATH the entries were found in
+  char *path_env;
+  // The last path found by a relative PATH directory, it is not cached
+  // since it depends on the current directory
+  char *uncached;
+};
+
+static uint32_t path_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name != '\0'; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+/*
+ * A function that removes all the entries of a cache
+ */
+static void path_cache_clear(struct path_cache *cache) {
+  for (uint32_t i = 0; i < cache->bucket_count; i++) {
+    struct path_entry *entry = cache->buckets[i];
+    while (entry != NULL) {
+      struct path_entry *next = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+    cache->buckets[i] = NULL;
+  }
+  cache->count = 0;
+}
+
+static void path_cache_delete(struct path_cache *cache) {
+  path_cache_clear(cache);
+  free(cache->buckets);
+  free(cache->path_env);
+  free(cache->uncached);
+}
+
+/*
+ * A function that doubles the number of buckets, so the chains stay
+ * about one entry long
+ */
+static void path_cache_grow(struct path_cache *cache) {
+  uint32_t bucket_count = cache->bucket_count == 0 ? 64 : cache->bucket_count * 2;
+  struct path_entry **buckets = calloc(bucket_count, sizeof(*buckets));
+  assert(buckets != NULL);
+
+  for (uint32_t i = 0; i < cache->bucket_count; i++) {
+    struct path_entry *entry = cache->buckets[i];
+    while (entry != NULL) {
+      struct path_entry *next = entry->next;
+      struct path_entry **head = &buckets[entry->hash & (bucket_count - 1)];
+      entry->next = *head;
+      *head = entry;
+      entry = next;
+    }
+  }
+
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucket_count = bucket_count;
+}
+
+/*
+ * A function that searches PATH for an executable, the same way as
+ * execvp does. Returns a new string or NULL if there is none
+ */
+static char *path_resolve(const char *path_env, const char *name) {
+  size_t name_len = strlen(name);
+  const char *dir = path_env;
+  while (true) {
+    const char *end = strchr(dir, ':');
+    size_t dir_len = end != NULL ? (size_t)(end - dir) : strlen(dir);
+
+    // An empty directory is the current one
+    char *path = malloc(dir_len + name_len + 3);
+    assert(path != NULL);
+    if (dir_len == 0)
+      sprintf(path, "./%s", name);
+    else
+      sprintf(path, "%.*s/%s", (int)dir_len, dir, name);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+      return path;
+    free(path);
+
+    if (end == NULL)
+      return NULL;
+    dir = end + 1;
+  }
+}
+
+/*
+ * A function that returns the path to run a command by, or NULL if it
+ * is not found. Names with a slash are paths already
+ */
+static const char *path_cache_find(struct path_cache *cache, const char *name) {
+  if (strchr(name, '/') != NULL)
+    return name;
+
+  free(cache->uncached);
+  cache->uncached = NULL;
+
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "/bin:/usr/bin";
+
+  if (cache->path_env == NULL || strcmp(cache->path_env, path_env) != 0) {
+    path_cache_clear(cache);
+    free(cache->path_env);
+    cache->path_env = strdup(path_env);
+    assert(cache->path_env != NULL);
+  }
+
+  uint32_t hash = path_hash(name);
+  if (cache->count > 0) {
+    struct path_entry *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+    for (; entry != NULL; entry = entry->next) {
+      if (entry->hash == hash && strcmp(entry->name, name) == 0)
+        return entry->path;
+    }
+  }
+
+  char *path = path_resolve(path_env, name);
+  if (path == NULL)
+    return NULL;
+
+  // Found by an empty or a relative directory, valid only until "cd"
+  if (path[0] != '/') {
+    cache->uncached = path;
+    return path;
+  }
+
+  if (cache->count >= cache->bucket_count)
+    path_cache_grow(cache);
+
+  struct path_entry *entry = malloc(sizeof(*entry));
+  assert(entry != NULL);
+  entry->name = strdup(name);
+  assert(entry->name != NULL);
+  entry->path = path;
+  entry->hash = hash;
+
+  struct path_entry **head = &cache->buckets[hash & (cache->bucket_count - 1)];
+  entry->next = *head;
+  *head = entry;
+  cache->count++;
+  return path;
+}
+
+/*
+ * A function that drops the entry of a command, when its cached
+ * file is gone
+ */
+static void path_cache_forget(struct path_cache *cache, const char *name) {
+  if (cache->count == 0)
+    return;
+
+  uint32_t hash = path_hash(name);
+  struct path_entry **link = &cache->buckets[hash & (cache->bucket_count - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    struct path_entry *entry = *link;
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      cache->count--;
+      return;
+    }
+  }
+}
+
+/*
+ * A builtin command. It gets the command and a descriptor to write
+ * its output to, and returns the exit code
+ */
+typedef int (*builtin_f)(const struct command *cmd, int out_fd);
+
+/*
+ * A function that writes the whole buffer, the builtins do not use
+ * stdio so nothing is left buffered when the shell forks
+ */
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rc = write(fd, data, size);
+    if (rc < 0)
+      return -1;
+    data += rc;
+    size -= rc;
+  }
+  return 0;
+}
+
+static int builtin_true(const struct command *cmd, int out_fd) {
+  (void)cmd;
+  (void)out_fd;
+  return 0;
+}
+
+static int builtin_false(const struct command *cmd, int out_fd) {
+  (void)cmd;
+  (void)out_fd;
+  return 1;
+}
+
+/*
+ * "echo" like the coreutils one, with -n, -e and -E options
+ */
+static int builtin_echo(const struct command *cmd, int out_fd) {
+  bool newline = true, escapes = false;
+  uint32_t first = 0;
+  for (; first < cmd->arg_count; first++) {
+    const char *arg = cmd->args[first];
+    if (arg[0] != '-' || arg[1] == '\0' || strspn(arg + 1, "neE") != strlen(arg + 1))
+      break;
+
+    for (arg++; *arg != '\0'; arg++) {
+      if (*arg == 'n')
+        newline = false;
+      else
+        escapes = *arg == 'e';
+    }
+  }
+
+  size_t size = 1;
+  for (uint32_t i = first; i < cmd->arg_count; i++)
+    size += strlen(cmd->args[i]) + 1;
+
+  char *buf = malloc(size);
+  assert(buf != NULL);
+  size_t len = 0;
+  for (uint32_t i = first; i < cmd->arg_count; i++) {
+    if (i > first)
+      buf[len++] = ' ';
+
+    for (const char *c = cmd->args[i]; *c != '\0'; c++) {
+      if (!escapes || c[0] != '\\' || c[1] == '\0') {
+        buf[len++] = *c;
+        continue;
+      }
+
+      // \c stops all the output
+      const char *from = "\\abefnrtv", *to = "\\\a\b\033\f\n\r\t\v";
+      const char *esc = strchr(from, *++c);
+      if (*c == 'c') {
+        newline = false;
+        i = cmd->arg_count;
+        break;
+      } else if (esc != NULL) {
+        buf[len++] = to[esc - from];
+      } else {
+        buf[len++] = '\\';
+        buf[len++] = *c;
+      }
+    }
+  }
+
+  if (newline)
+    buf[len++] = '\n';
+
+  int rc = write_all(out_fd, buf, len);
+  free(buf);
+  return rc == 0 ? 0 : 1;
+}
+
+static int builtin_pwd(const struct command *cmd, int out_fd) {
+  (void)cmd;
+  char buf[PATH_MAX + 1];
+  if (getcwd(buf, PATH_MAX) == NULL) {
+    fprintf(stderr, "pwd: %s\n", strerror(errno));
+    return 1;
+  }
+
+  size_t len = strlen(buf);
+  buf[len++] = '\n';
+  return write_all(out_fd, buf, len) == 0 ? 0 : 1;
+}
+
+static int builtin_cd(const struct command *cmd, int out_fd) {
+  (void)out_fd;
+  const char *dir = cmd->arg_count > 0 ? cmd->args[0] : getenv("HOME");
+  if (dir == NULL || chdir(dir) != 0) {
+    fprintf(stderr, "cd: %s\n", dir == NULL ? "HOME not set" : strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * "exit" in a pipeline only ends its own part of it, the shell itself
+ * is exited in main
+ */
+static int builtin_exit(const struct command *cmd, int out_fd) {
+  (void)out_fd;
+  return cmd->arg_count > 0 ? atoi(cmd->args[0]) & 0xff : 0;
+}
+
+/*
+ * A function that evaluates a unary test: -n, -z and the file checks
+ */
+static int test_unary(const char *op, const char *arg) {
+  struct stat st;
+  if (strcmp(op, "-n") == 0)
+    return arg[0] != '\0';
+  if (strcmp(op, "-z") == 0)
+    return arg[0] == '\0';
+  if (strcmp(op, "-r") == 0)
+    return access(arg, R_OK) == 0;
+  if (strcmp(op, "-w") == 0)
+    return access(arg, W_OK) == 0;
+  if (strcmp(op, "-x") == 0)
+    return access(arg, X_OK) == 0;
+
+  if (strlen(op) != 2 || op[0] != '-' || strchr("edfs", op[1]) == NULL)
+    return -1;
+  if (stat(arg, &st) != 0)
+    return 0;
+  if (op[1] == 'd')
+    return S_ISDIR(st.st_mode);
+  if (op[1] == 'f')
+    return S_ISREG(st.st_mode);
+  if (op[1] == 's')
+    return st.st_size > 0;
+  return 1;
+}
+
+/*
+ * A function that evaluates a binary test: string and integer
+ * comparisons
+ */
+static int test_binary(const char *left, const char *op, const char *right) {
+  if (strcmp(op, "=") == 0)
+    return strcmp(left, right) == 0;
+  if (strcmp(op, "!=") == 0)
+    return strcmp(left, right) != 0;
+
+  const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  int op_index = -1;
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(op, ops[i]) == 0)
+      op_index = i;
+  }
+
+  char *left_end, *right_end;
+  long long a = strtoll(left, &left_end, 10);
+  long long b = strtoll(right, &right_end, 10);
+  if (op_index < 0 || left[0] == '\0' || *left_end != '\0' || right[0] == '\0' ||
+      *right_end != '\0')
+    return -1;
+
+  switch (op_index) {
+  case 0:
+    return a == b;
+  case 1:
+    return a != b;
+  case 2:
+    return a < b;
+  case 3:
+    return a <= b;
+  case 4:
+    return a > b;
+  default:
+    return a >= b;
+  }
+}
+
+/*
+ * "test" and "[" with up to 4 arguments, as POSIX defines them by the
+ * argument count. Returns 2 on a bad expression
+ */
+static int builtin_test(const struct command *cmd, int out_fd) {
+  (void)out_fd;
+  char **args = cmd->args;
+  uint32_t count = cmd->arg_count;
+  if (strcmp(cmd->exe, "[") == 0) {
+    if (count == 0 || strcmp(args[count - 1], "]") != 0) {
+      fprintf(stderr, "[: missing ]\n");
+      return 2;
+    }
+    count--;
+  }
+
+  bool negate = false;
+  if (count > 2 && strcmp(args[0], "!") == 0 &&
+      !(count == 3 && test_binary(args[0], args[1], args[2]) >= 0)) {
+    negate = true;
+    args++;
+    count--;
+  }
+
+  int result;
+  if (count == 0)
+    result = 0;
+  else if (count == 1)
+    result = args[0][0] != '\0';
+  else if (count == 2 && strcmp(args[0], "!") == 0)
+    result = args[1][0] == '\0';
+  else if (count == 2)
+    result = test_unary(args[0], args[1]);
+  else if (count == 3)
+    result = test_binary(args[0], args[1], args[2]);
+  else
+    result = -1;
+
+  if (result < 0) {
+    fprintf(stderr, "%s: bad expression\n", cmd->exe);
+    return 2;
+  }
+  return result != negate ? 0 : 1;
+}
+
+struct builtin {
+  const char *name;
+  builtin_f func;
+  // Run in the shell even in a pipeline, since it changes the shell
+  bool is_in_shell;
+};
+
+static const struct builtin builtins[] = {
+    {"cd", builtin_cd, true},
+    {"echo", builtin_echo, false},
+    {"exit", builtin_exit, false},
+    {"false", builtin_false, false},
+    {"pwd", builtin_pwd, false},
+    {"test", builtin_test, false},
+    {"[", builtin_test, false},
+    {"true", builtin_true, false},
+};
+
+/*
+ * A function that returns the builtin of a command, or NULL if it is
+ * an external one
+ */
+static const struct builtin *find_builtin(const char *name) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (strcmp(builtins[i].name, name) == 0)
+      return &builtins[i];
+  }
+  return NULL;
+}
+
+/*
+ * A function that runs a builtin of a pipeline in a child. It is
+ * forked without exec, so it costs no program loading and no PATH
+ * search
+ */
+static int spawn_builtin(pid_t *pid, const struct builtin *builtin,
+                         const struct command *cmd, int in_fd, int out_fd,
+                         int num_pipes, int (*pd)[2]) {
+  *pid = fork();
+  if (*pid < 0)
+    return errno;
+
+  if (*pid == 0) {
+    if (in_fd != -1)
+      dup2(in_fd, STDIN_FILENO);
+
+    if (out_fd != -1)
+      dup2(out_fd, STDOUT_FILENO);
+
+    // Close pipes in child process
+    for (int i = 0; i < num_pipes; i++) {
+      close(pd[i][0]);
+      close(pd[i][1]);
+    }
+
+    _exit(builtin->func(cmd, STDOUT_FILENO));
+  }
+
+  return 0;
+}
+
+#ifdef SHELL_USE_FORK
+
+/*
+ * A function that starts a command with its stdin and stdout set to
+ * the given descriptors, via fork and execv. It copies the page
+ * tables of the whole shell per command, and is kept to compare with.
+ * An exec error is sent to the parent by a close-on-exec pipe, so it
+ * is returned the same way as from posix_spawn
+ */
+static int spawn_command(pid_t *pid, const char *path, char **argv, int in_fd,
+                         int out_fd, int num_pipes, int (*pd)[2]) {
+  int err_pipe[2];
+  if (pipe(err_pipe) != 0)
+    return errno;
+  fcntl(err_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(err_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  *pid = fork();
+  if (*pid < 0) {
+    int err = errno;
+    close(err_pipe[0]);
+    close(err_pipe[1]);
+    return err;
+  }
+
+  if (*pid == 0) {
+    if (in_fd != -1)
+      dup2(in_fd, STDIN_FILENO);
+
+    if (out_fd != -1)
+      dup2(out_fd, STDOUT_FILENO);
+
+    // Close pipes in child process
+    for (int i = 0; i < num_pipes; i++) {
+      close(pd[i][0]);
+      close(pd[i][1]);
+    }
+
+    execv(path, argv);
+    int err = errno;
+    write(err_pipe[1], &err, sizeof(err));
+    _exit(127);
+  }
+
+  // Nothing is read, if the exec has succeeded and closed the pipe
+  int err = 0;
+  close(err_pipe[1]);
+  if (read(err_pipe[0], &err, sizeof(err)) == sizeof(err))
+    waitpid(*pid, NULL, 0);
+  else
+    err = 0;
+  close(err_pipe[0]);
+  return err;
+}
+
+#else
+
+/*
+ * A function that starts a command with its stdin and stdout set to
+ * the given descriptors. The pipe and redirect setup is described as
+ * file actions, so posix_spawn can start the child without copying
+ * the shell (glibc runs it on a separate stack in the shared address
+ * space, like vfork). Returns 0 or an errno, the command is not
+ * started then
+ */
+static int spawn_command(pid_t *pid, const char *path, char **argv, int in_fd,
+                         int out_fd, int num_pipes, int (*pd)[2]) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  if (in_fd != -1)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+
+  if (out_fd != -1)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+  // Close pipes in child process
+  for (int i = 0; i < num_pipes; i++) {
+    posix_spawn_file_actions_addclose(&actions, pd[i][0]);
+    posix_spawn_file_actions_addclose(&actions, pd[i][1]);
+  }
+
+  int rc = posix_spawn(pid, path, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  return rc;
+}
+
+#endif
+
+/*
+ * A function that starts a file without a "#!" line as a script, the
+ * way execvp does it on ENOEXEC: /bin/sh gets the path of the file and
+ * the arguments
+ */
+static int spawn_script(pid_t *pid, const char *path, char **argv, int in_fd,
+                        int out_fd, int num_pipes, int (*pd)[2]) {
+  int argc = 0;
+  while (argv[argc] != NULL)
+    argc++;
+
+  char *sh_argv[argc + 2];
+  sh_argv[0] = "/bin/sh";
+  sh_argv[1] = (char *)path;
+  for (int i = 1; i <= argc; i++)
+    sh_argv[i + 1] = argv[i];
+
+  return spawn_command(pid, "/bin/sh", sh_argv, in_fd, out_fd, num_pipes, pd);
+}
+
 /*
  * A function that executes commands in a command line
  */
 static int execute_commands(const struct command_line *line, int num_pipes,
-                            int *redirect_fd, int (*pd)[2]) {
+                            int *redirect_fd, int (*pd)[2],
+                            struct argv_buf *args, struct path_cache *cache) {
   struct expr *e = line->head;
-  int index = 0, last_exit_code = 0;
+  int index = 0, pipe_index = 0, last_exit_code = 0;
+  bool after_pipe = false;
+
+  // "&&" and "||" join commands too, so there can be more commands
+  // than pipes + 1
+  int num_commands = get_num_commands(line);
+  pid_t pids[num_commands];
+  int exit_codes[num_commands];
   while (e != NULL) {
     if (e->type == EXPR_TYPE_COMMAND) {
-      // Initialize the command in an array format for execvp
-      char *argv_arr[e->cmd.arg_count + 2];
-      argv_arr[0] = e->cmd.exe;
-
-      for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
-        argv_arr[i + 1] = e->cmd.args[i];
-
-      argv_arr[e->cmd.arg_count + 1] = NULL;
-
-      // Manually handle "cd"
-      if (strcmp(e->cmd.exe, "cd") == 0) {
-        chdir(e->cmd.args[0]);
+      // No child for a builtin run in the shell
+      pids[index] = 0;
+      exit_codes[index] = 0;
+
+      // Only the commands joined by a pipe are connected, the redirect
+      // is for the last command
+      bool before_pipe = e->next != NULL && e->next->type == EXPR_TYPE_PIPE;
+      int in_fd = after_pipe ? pd[pipe_index - 1][0] : -1;
+      int out_fd = before_pipe ? pd[pipe_index][1] : -1;
+      if (e->next == NULL)
+        out_fd = *redirect_fd;
+      const struct builtin *builtin = find_builtin(e->cmd.exe);
+
+      // Builtins out of a pipeline are run right in the shell
+      if (builtin != NULL && ((!after_pipe && !before_pipe) || builtin->is_in_shell)) {
+        exit_codes[index] = builtin->func(&e->cmd, out_fd != -1 ? out_fd : STDOUT_FILENO);
+      } else if (builtin != NULL) {
+        int rc = spawn_builtin(&pids[index], builtin, &e->cmd, in_fd, out_fd, num_pipes, pd);
+        if (rc != 0) {
+          fprintf(stderr, "%s: %s\n", e->cmd.exe, strerror(rc));
+          exit_codes[index] = 1;
+        }
       } else {
+        char **argv = argv_buf_fill(args, &e->cmd);
+
+        const char *path = path_cache_find(cache, argv[0]);
+        int rc = ENOENT;
+        if (path != NULL)
+          rc = spawn_command(&pids[index], path, argv, in_fd, out_fd, num_pipes, pd);
+
+        // The cached file could be removed or lose its permissions since,
+        // search for it again
+        if ((rc == ENOENT || rc == EACCES) && path != NULL && path != argv[0]) {
+          path_cache_forget(cache, argv[0]);
+          path = path_cache_find(cache, argv[0]);
+          if (path != NULL)
+            rc = spawn_command(&pids[index], path, argv, in_fd, out_fd, num_pipes, pd);
+        }
+
+        if (rc == ENOEXEC)
+          rc = spawn_script(&pids[index], path, argv, in_fd, out_fd, num_pipes, pd);
 
-        // fork and configure pipes in child process
-        pid_t p = fork();
-        if (p == 0) {
-          if (index > 0) {
-            dup2(pd[index - 1][0], STDIN_FILENO);
-          }
-
-          if (index < num_pipes) {
-            dup2(pd[index][1], STDOUT_FILENO);
-          }
-
-          // Handle redirects if any
-          if (index == num_pipes && *redirect_fd != -1) {
-            dup2(*redirect_fd, STDOUT_FILENO);
-          }
-
-          // Close pipes in child process
-          for (int i = 0; i < num_pipes; i++) {
-            close(pd[i][0]);
-            close(pd[i][1]);
-          }
-
-          // Use a dummy executable in place of exit (it will clean up its memory)
-          if (strcmp(e->cmd.exe, "exit") == 0) {
-            char *_true[2] = {"true", NULL};
-            execvp("true", _true);
-          }
-
-          execvp(e->cmd.exe, argv_arr);
+        if (rc != 0) {
+          fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+          pids[index] = 0;
+          exit_codes[index] = 127;
         }
       }
 
       index++;
+    } else if (e->type == EXPR_TYPE_PIPE) {
+      pipe_index++;
     }
 
+    after_pipe = e->type == EXPR_TYPE_PIPE;
     e = e->next;
   }
 
   // Close pipes in parent process 
   delete_pipes(num_pipes, redirect_fd, pd);
 
-  // Wait for all children to finish and save the last exit code
-  for (int i = 0; i < num_pipes + 1; i++) {
+  // Wait for all children to finish and save the exit code of the last
+  // command
+  for (int i = 0; i < index; i++) {
+    if (pids[i] == 0) {
+      last_exit_code = exit_codes[i];
+      continue;
+    }
+
     int status = 0;
-    wait(&status);
+    waitpid(pids[i], &status, 0);
     last_exit_code = status;
 
     if (status > 0)
@@ -146,7 +804,9 @@ static int execute_commands(const struct command_line *line, int num_pipes,
 /*
  * A function that executes a command line
  */
-static int execute_command_line(const struct command_line *line) {
+static int execute_command_line(const struct command_line *line,
+                                struct argv_buf *args,
+                                struct path_cache *cache) {
 
   int num_pipes = get_num_pipes(line);
 
@@ -156,7 +816,7 @@ static int execute_command_line(const struct command_line *line) {
 
   // Initialize pipes then execute, save the last exit code
   initialize_pipes(line, num_pipes, &redirect_fd, pd);
-  last_exit_code = execute_commands(line, num_pipes, &redirect_fd, pd);
+  last_exit_code = execute_commands(line, num_pipes, &redirect_fd, pd, args, cache);
 
   return last_exit_code;
 }
@@ -167,6 +827,8 @@ int main(void) {
   int rc;
   int exit_code = 0;
   struct parser *p = parser_new();
+  struct argv_buf args = {NULL, 0};
+  struct path_cache cache = {NULL, 0, 0, NULL, NULL};
   while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
     parser_feed(p, buf, rc);
     struct command_line *line = NULL;
@@ -189,25 +851,21 @@ int main(void) {
 
         command_line_delete(line);
         parser_delete(p);
+        free(args.data);
+        path_cache_delete(&cache);
 
         exit(exit_code);
       }
 
-      exit_code = execute_command_line(line);
-
-      // Handle case where exit is the last command in the line 
-      // get its exit code to exit with it later
-      if (strcmp(line->tail->cmd.exe, "exit") == 0) {
-        if (line->tail->cmd.arg_count)
-          exit_code = atoi(line->tail->cmd.args[0]);
-
-        else
-          exit_code = 0;
-      }
+      // When exit is the last command in the line, its exit code is
+      // the one to exit with later
+      exit_code = execute_command_line(line, &args, &cache);
 
       command_line_delete(line);
     }
   }
   parser_delete(p);
+  free(args.data);
+  path_cache_delete(&cache);
   return exit_code;
 }